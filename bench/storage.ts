@@ -0,0 +1,83 @@
+// Compares the storage modes for state that changes every frame: the cost
+// of adding and removing it per entity, and of iterating the entities that
+// have it. Run with `bun bench/storage.ts [entities] [frames]`.
+import { Storage, World, type Entity } from "..";
+
+const count = Number(process.argv[2] ?? 10_000);
+const frames = Number(process.argv[3] ?? 20);
+
+using world = new World();
+world.parse(`
+struct Burn {
+  value = f32
+}
+`).eval();
+const burn = world.lookup("Burn")!;
+const stunned = world.new_named("Stunned");
+const status = world.new_named("Status");
+const poisoned = world.new_named("Poisoned");
+const frozen = world.new_named("Frozen");
+const slowed = world.new_named("Slowed");
+world.storage(burn, Storage.Sparse);
+world.storage(status, Storage.Union);
+world.storage(slowed, Storage.Toggle);
+
+const pair = (first: Entity, second: Entity) =>
+  (1n << 63n) |
+  ((first.native & 0xffffffffn) << 32n) |
+  (second.native & 0xffffffffn);
+
+const entities = Array.from({ length: count }, () => world.new());
+for (const entity of entities) {
+  entity.add(pair(status, poisoned));
+  entity.add(slowed);
+}
+
+const modes = [
+  {
+    name: "table tag",
+    expr: "Stunned",
+    on: (e: Entity) => e.add(stunned),
+    off: (e: Entity) => e.remove(stunned),
+  },
+  {
+    name: "sparse",
+    expr: "Burn",
+    on: (e: Entity) => e.add(burn),
+    off: (e: Entity) => e.remove(burn),
+  },
+  {
+    name: "union",
+    expr: "(Status, Frozen)",
+    on: (e: Entity) => e.add(pair(status, frozen)),
+    off: (e: Entity) => e.add(pair(status, poisoned)),
+  },
+  {
+    name: "toggle",
+    expr: "Slowed",
+    on: (e: Entity) => e.enable(slowed, true),
+    off: (e: Entity) => e.enable(slowed, false),
+  },
+];
+
+const rows = [];
+for (const { name, expr, on, off } of modes) {
+  const start = performance.now();
+  for (let frame = 0; frame < frames; frame++) {
+    for (const entity of entities) on(entity);
+    for (const entity of entities) off(entity);
+  }
+  const churn = ((performance.now() - start) * 1e6) / (frames * count * 2);
+  // Leave every other entity with the state on.
+  for (let i = 0; i < count; i += 2) on(entities[i]);
+  using query = world.query(expr);
+  const profile = query.profile(100);
+  rows.push({
+    mode: name,
+    "churn ns/op": churn.toFixed(1),
+    "iterate us": profile.time_us.avg.toFixed(2),
+    results: profile.results,
+    entities: profile.entities,
+  });
+}
+console.table(rows);
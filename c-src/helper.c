@@ -1,6 +1,14 @@
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
 #include "./flecs.h"
 #include "./js_native_api.h"
 #include "./js_native_api_types.h"
+#include "./node_api.h"
 
 #define TRY_(expr, label)                                                      \
   if ((status = expr) != napi_ok)                                              \
@@ -51,7 +59,10 @@ static napi_status jsSymbolDispose(napi_env env, napi_value *target) {
 }
 
 ecs_entity_t ecs_script_init_code(ecs_world_t *world, char const *code) {
-  return ecs_script(world, {.code = code});
+  ecs_os_perf_trace_push("flecs.script.eval");
+  ecs_entity_t result = ecs_script(world, {.code = code});
+  ecs_os_perf_trace_pop("flecs.script.eval");
+  return result;
 }
 
 napi_value ecs_get_type_js(napi_env env, ecs_world_t const *world,
@@ -183,14 +194,85 @@ static ecs_entity_t jsGetNativeHandle(napi_env env, napi_value value) {
   return result;
 }
 
-static napi_value ecsQueryExec(napi_env env, napi_callback_info info) {
-  napi_value result, arg;
+// Resolves a path, entity id or Entity. Returns false for other values.
+static bool jsGetEntity(napi_env env, ecs_world_t *world, napi_value value,
+                        ecs_entity_t *result) {
+  size_t len;
+  switch (jsType(env, value)) {
+  case napi_string: {
+    napi_get_value_string_utf8(env, value, NULL, 0, &len);
+    char *path = ecs_os_malloc(len + 1);
+    napi_get_value_string_utf8(env, value, path, len + 1, &len);
+    *result = ecs_lookup(world, path);
+    ecs_os_free(path);
+    return true;
+  }
+  case napi_bigint:
+    napi_get_value_bigint_uint64(env, value, result, NULL);
+    return true;
+  case napi_object:
+    *result = jsGetNativeHandle(env, value);
+    return true;
+  default:
+    return false;
+  }
+}
+
+#define QUERY_BINDING_CACHE_SIZE 16
+
+typedef struct query_binding {
+  char *key;
   ecs_query_t *query;
-  size_t argc = 1;
-  napi_get_cb_info(env, info, &argc, &arg, NULL, (void **)&query);
-  ecs_iter_t iter = ecs_query_iter(query->world, query);
-  ecs_iter_to_json_desc_t desc = ECS_ITER_TO_JSON_INIT;
-  if (argc == 1 && jsType(env, arg) == napi_object) {
+  uint64_t used;
+} query_binding_t;
+
+// Kept as the query's binding_ctx. Each entry is a cached query compiled from
+// the expression with its variables replaced by bound entities, so flecs
+// keeps the matched tables up to date as tables come and go. Bound queries
+// are grouped the same way as the query itself. ecsQueryDispose finis them;
+// if the world goes first, it finis them along with every other query and
+// only the cache itself is left to queryBindingFree.
+typedef struct query_binding_cache {
+  char *expr;
+  ecs_id_t group_by;
+  ecs_group_by_action_t group_by_callback;
+  uint64_t clock;
+  int32_t jobs;
+  bool owned;
+  query_binding_t bindings[QUERY_BINDING_CACHE_SIZE];
+} query_binding_cache_t;
+
+// Limits `iter` to the group in the "group" option. Only queries created with
+// group_by can seek to a group, so it throws for others, as it does when the
+// group does not resolve; returns false then. `iter` may be over one of the
+// query's bound queries, which are grouped alike.
+static bool queryExecGroup(napi_env env, napi_value arg, ecs_query_t *query,
+                           ecs_iter_t *iter) {
+  query_binding_cache_t *cache = query->binding_ctx;
+  napi_value value;
+  ecs_entity_t group = 0;
+  napi_get_named_property(env, arg, "group", &value);
+  napi_valuetype type = jsType(env, value);
+  if (type == napi_undefined || type == napi_null)
+    return true;
+  if (!cache->group_by && !cache->group_by_callback) {
+    napi_throw_error(env, NULL, "query has no group_by");
+    return false;
+  }
+  if (!jsGetEntity(env, query->world, value, &group) ||
+      (type == napi_string && !group)) {
+    napi_throw_error(env, NULL, "failed to resolve group");
+    return false;
+  }
+  ecs_iter_set_group(iter, group);
+  return true;
+}
+
+// Applies the exec options in `arg` to `iter` and `desc`. Returns false if
+// an option threw.
+static bool queryExecOptions(napi_env env, napi_value arg, ecs_query_t *query,
+                             ecs_iter_t *iter, ecs_iter_to_json_desc_t *desc) {
+  if (jsType(env, arg) == napi_object) {
     napi_value vars;
     napi_get_named_property(env, arg, "variables", &vars);
     if (jsType(env, vars) == napi_object) {
@@ -201,7 +283,7 @@ static napi_value ecsQueryExec(napi_env env, napi_callback_info info) {
       char *strbuf = NULL;
       for (uint32_t i = 0; i < props_len; i++) {
         napi_value key, value;
-        size_t keylen, vallen;
+        size_t keylen;
         ecs_entity_t target;
         napi_get_element(env, props, i, &key);
         napi_get_property(env, vars, key, &value);
@@ -209,36 +291,518 @@ static napi_value ecsQueryExec(napi_env env, napi_callback_info info) {
         strbuf = ecs_os_realloc(strbuf, nextsize(keylen + 1, 256));
         napi_get_value_string_utf8(env, key, strbuf, keylen + 1, &keylen);
         int32_t varidx = ecs_query_find_var(query, strbuf);
-        if (varidx == 0)
+        if (varidx <= 0)
           continue;
-        switch (jsType(env, value)) {
-        case napi_string:
-          napi_get_value_string_utf8(env, value, NULL, 0, &vallen);
-          strbuf = ecs_os_realloc(strbuf, nextsize(vallen + 1, 256));
-          napi_get_value_string_utf8(env, value, strbuf, vallen + 1, &vallen);
-          target = ecs_lookup(iter.world, strbuf);
-          ecs_iter_set_var(&iter, varidx, target);
-          break;
-        case napi_bigint:
-          napi_get_value_bigint_uint64(env, value, &target, NULL);
-          ecs_iter_set_var(&iter, varidx, target);
-          break;
-        case napi_object:
-          target = jsGetNativeHandle(env, value);
-          ecs_iter_set_var(&iter, varidx, target);
-          break;
-        default:
-          break;
-        }
+        if (jsGetEntity(env, iter->world, value, &target))
+          ecs_iter_set_var(iter, varidx, target);
       }
       ecs_os_free(strbuf);
     }
-    desc.serialize_table = jsGetBoolFlag(env, arg, "table");
-    desc.serialize_builtin = jsGetBoolFlag(env, arg, "builtin");
-    desc.serialize_inherited = jsGetBoolFlag(env, arg, "inherited");
-    desc.serialize_matches = jsGetBoolFlag(env, arg, "matches");
+    if (!queryExecGroup(env, arg, query, iter))
+      return false;
+    desc->serialize_table = jsGetBoolFlag(env, arg, "table");
+    desc->serialize_builtin = jsGetBoolFlag(env, arg, "builtin");
+    desc->serialize_inherited = jsGetBoolFlag(env, arg, "inherited");
+    desc->serialize_matches = jsGetBoolFlag(env, arg, "matches");
+  }
+  return true;
+}
+
+// Also called when ecs_query_init fails, before the query owns the cache,
+// in which case ecs_query_expr_js frees it.
+static void queryBindingFree(void *ctx) {
+  query_binding_cache_t *cache = ctx;
+  if (!cache->owned)
+    return;
+  for (int32_t i = 0; i < QUERY_BINDING_CACHE_SIZE; i++)
+    ecs_os_free(cache->bindings[i].key);
+  ecs_os_free(cache->expr);
+  ecs_os_free(cache);
+}
+
+// Rewrites `$name` for every variable bound on `iter` to the bound entity as
+// `#index`, which resolves to the alive entity whatever its name holds.
+// Quoted strings are copied as they are.
+static char *queryBindExpr(const char *expr, ecs_iter_t *iter) {
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  bool bound = false;
+  for (const char *ch = expr; *ch;) {
+    if (*ch == '"') {
+      const char *start = ch++;
+      while (*ch && *ch != '"')
+        ch += ch[0] == '\\' && ch[1] ? 2 : 1;
+      if (*ch)
+        ch++;
+      ecs_strbuf_appendstrn(&buf, start, ch - start);
+      continue;
+    }
+    if (*ch != '$') {
+      ecs_strbuf_appendch(&buf, *ch++);
+      continue;
+    }
+    const char *name = ++ch;
+    while (isalnum((unsigned char)*ch) || *ch == '_')
+      ch++;
+    int32_t var = 0;
+    for (int32_t i = 1; !var && i < iter->variable_count; i++)
+      if ((iter->constrained_vars & (1llu << i)) &&
+          !strncmp(iter->variable_names[i], name, ch - name) &&
+          !iter->variable_names[i][ch - name])
+        var = i;
+    if (var) {
+      ecs_strbuf_append(&buf, "#%u", (uint32_t)ecs_iter_get_var(iter, var));
+      bound = true;
+    } else {
+      ecs_strbuf_appendch(&buf, '$');
+      ecs_strbuf_appendstrn(&buf, name, ch - name);
+    }
+  }
+  char *result = ecs_strbuf_get(&buf);
+  if (!bound) {
+    ecs_os_free(result);
+    return NULL;
+  }
+  return result;
+}
+
+// Returns the cached query for the variables bound on `iter`, compiling it
+// on first use and evicting the least recently used binding when full.
+// Bindings are keyed by the full ids, so a recycled index gets its own.
+static ecs_query_t *queryBindingGet(ecs_query_t *query, ecs_iter_t *iter) {
+  query_binding_cache_t *cache = query->binding_ctx;
+  if (!(query->flags & EcsQueryMatchThis))
+    return NULL;
+  char *expr = queryBindExpr(cache->expr, iter);
+  if (!expr)
+    return NULL;
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  ecs_strbuf_appendstr(&buf, expr);
+  for (int32_t i = 1; i < iter->variable_count; i++)
+    if (iter->constrained_vars & (1llu << i))
+      ecs_strbuf_append(&buf, "|%llu",
+                        (unsigned long long)ecs_iter_get_var(iter, i));
+  char *key = ecs_strbuf_get(&buf);
+  query_binding_t *slot = &cache->bindings[0];
+  for (int32_t i = 0; i < QUERY_BINDING_CACHE_SIZE; i++) {
+    query_binding_t *binding = &cache->bindings[i];
+    if (binding->key && !strcmp(binding->key, key)) {
+      ecs_os_free(expr);
+      ecs_os_free(key);
+      binding->used = ++cache->clock;
+      return binding->query;
+    }
+    if (binding->used < slot->used)
+      slot = binding;
+  }
+  ecs_query_t *bound =
+      ecs_query(query->world, {.expr = expr,
+                               .cache_kind = EcsQueryCacheAuto,
+                               .group_by = cache->group_by,
+                               .group_by_callback = cache->group_by_callback});
+  ecs_os_free(expr);
+  if (!bound) {
+    ecs_os_free(key);
+    return NULL;
+  }
+  if (slot->query)
+    ecs_query_fini(slot->query);
+  ecs_os_free(slot->key);
+  slot->key = key;
+  slot->query = bound;
+  slot->used = ++cache->clock;
+  return bound;
+}
+
+typedef struct query_bound_iter {
+  ecs_iter_t iter;
+  ecs_iter_t tables;
+  ecs_query_t *query;
+  ecs_table_t *table;
+  uint64_t bound_vars;
+  ecs_entity_t vars[64];
+} query_bound_iter_t;
+
+// Next action for the iterator serialized by queryBoundJson. Each table the
+// bound query yields is iterated by the query itself, with its variables
+// set and $this limited to the table.
+static bool queryBoundNext(ecs_iter_t *it) {
+  query_bound_iter_t *b = (query_bound_iter_t *)it;
+  while (!b->table || !ecs_query_next(it)) {
+    ecs_table_t *prev = b->table;
+    do {
+      if (!ecs_query_next(&b->tables))
+        return false;
+    } while (b->tables.table == prev);
+    ecs_flags32_t flags = it->flags & EcsIterNoData;
+    *it = ecs_query_iter(it->real_world, b->query);
+    it->flags |= flags;
+    for (int32_t i = 1; i < 64; i++)
+      if (b->bound_vars & (1llu << i))
+        ecs_iter_set_var(it, i, b->vars[i]);
+    ecs_iter_set_var_as_table(it, 0, b->tables.table);
+    b->table = b->tables.table;
+  }
+  return true;
+}
+
+// Serializes the results of `iter` from the tables matched by `bound`, so
+// they look the same as those of iterating `iter` itself. Finis `iter`.
+static char *queryBoundJson(napi_env env, napi_value arg, ecs_query_t *query,
+                            ecs_query_t *bound, ecs_iter_t *iter,
+                            const ecs_iter_to_json_desc_t *desc) {
+  query_bound_iter_t b = {.query = query};
+  for (int32_t i = 1; i < iter->variable_count && i < 64; i++) {
+    if (iter->constrained_vars & (1llu << i)) {
+      b.bound_vars |= 1llu << i;
+      b.vars[i] = ecs_iter_get_var(iter, i);
+    }
+  }
+  // Iterators release their memory in reverse order of creation, so the
+  // query's own iterator must go before the bound one is created.
+  ecs_iter_fini(iter);
+  b.iter = *iter;
+  b.iter.next = queryBoundNext;
+  b.tables = ecs_query_iter(query->world, bound);
+  queryExecGroup(env, arg, query, &b.tables);
+  char *json = ecs_iter_to_json(&b.iter, desc);
+  if (b.tables.flags & EcsIterIsValid)
+    ecs_iter_fini(&b.tables);
+  return json;
+}
+
+// Number of running jobs per world, only touched on the JS thread. The world
+// stays readonly until the last one completes. The workers read the entity
+// index and tables unlocked, so anything that allocates ids, creates queries
+// or changes the world throws until then, see queryJobsPending and, on the
+// JS side, assertNoQueryJobs.
+static ecs_map_t queryJobCounts;
+
+// Number of execAsync jobs serializing from `world`.
+int32_t ecs_query_jobs(const ecs_world_t *world) {
+  ecs_map_val_t *count = ecs_map_is_init(&queryJobCounts)
+                             ? ecs_map_get(&queryJobCounts, (uintptr_t)world)
+                             : NULL;
+  return count ? (int32_t)*count : 0;
+}
+
+// Throws and returns true while jobs are serializing from `world`.
+static bool queryJobsPending(napi_env env, const ecs_world_t *world) {
+  if (!ecs_query_jobs(world))
+    return false;
+  napi_throw_error(env, NULL, "world has pending query jobs");
+  return true;
+}
+
+static napi_value ecsQueryExec(napi_env env, napi_callback_info info) {
+  napi_value result, arg;
+  ecs_query_t *query;
+  size_t argc = 1;
+  napi_get_cb_info(env, info, &argc, &arg, NULL, (void **)&query);
+  ecs_iter_t iter = ecs_query_iter(query->world, query);
+  ecs_iter_to_json_desc_t desc = ECS_ITER_TO_JSON_INIT;
+  if (argc == 1 && !queryExecOptions(env, arg, query, &iter, &desc)) {
+    ecs_iter_fini(&iter);
+    return NULL;
+  }
+  ecs_query_t *bound = NULL;
+  if (argc == 1 && jsType(env, arg) == napi_object &&
+      jsGetBoolFlag(env, arg, "cache")) {
+    if (queryJobsPending(env, query->world)) {
+      ecs_iter_fini(&iter);
+      return NULL;
+    }
+    bound = queryBindingGet(query, &iter);
+  }
+  char *str = bound ? queryBoundJson(env, arg, query, bound, &iter, &desc)
+                    : ecs_iter_to_json(&iter, &desc);
+  napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &result);
+  ecs_os_free(str);
+  return result;
+}
+
+typedef struct query_job {
+  napi_async_work work;
+  napi_deferred deferred;
+  ecs_query_t *query;
+  ecs_world_t *world, *stage;
+  ecs_iter_t iter;
+  ecs_iter_to_json_desc_t desc;
+  char *json;
+} query_job_t;
+
+static void queryJobExecute(napi_env env, void *data) {
+  (void)env;
+  query_job_t *job = data;
+  job->json = ecs_iter_to_json(&job->iter, &job->desc);
+}
+
+static void queryJobComplete(napi_env env, napi_status status, void *data) {
+  query_job_t *job = data;
+  napi_value result;
+  query_binding_cache_t *cache = job->query->binding_ctx;
+  cache->jobs--;
+  ecs_map_val_t *count = ecs_map_get(&queryJobCounts, (uintptr_t)job->world);
+  if (!--*count) {
+    ecs_map_remove(&queryJobCounts, (uintptr_t)job->world);
+    ecs_readonly_end(job->world);
+  }
+  ecs_stage_free(job->stage);
+  if (status == napi_ok && job->json) {
+    napi_create_string_utf8(env, job->json, NAPI_AUTO_LENGTH, &result);
+    napi_resolve_deferred(env, job->deferred, result);
+  } else {
+    napi_create_string_utf8(env, "query serialization failed",
+                            NAPI_AUTO_LENGTH, &result);
+    napi_create_error(env, NULL, result, &result);
+    napi_reject_deferred(env, job->deferred, result);
+  }
+  napi_delete_async_work(env, job->work);
+  ecs_os_free(job->json);
+  ecs_os_free(job);
+}
+
+// Serializes on a thread pool thread through a private stage, so the JS
+// thread only pays for setting up the iterator.
+static napi_value ecsQueryExecAsync(napi_env env, napi_callback_info info) {
+  napi_value result, arg, name;
+  ecs_query_t *query;
+  size_t argc = 1;
+  napi_get_cb_info(env, info, &argc, &arg, NULL, (void **)&query);
+  ecs_world_t *world = query->world;
+  if (ecs_stage_is_readonly(world) && !ecs_query_jobs(world)) {
+    napi_throw_error(env, NULL, "world is already readonly");
+    return NULL;
+  }
+  query_job_t *job = ecs_os_calloc_t(query_job_t);
+  job->query = query;
+  job->world = world;
+  job->stage = ecs_stage_new(world);
+  job->iter = ecs_query_iter(job->stage, query);
+  job->desc = ECS_ITER_TO_JSON_INIT;
+  if (argc == 1 &&
+      !queryExecOptions(env, arg, query, &job->iter, &job->desc)) {
+    ecs_iter_fini(&job->iter);
+    ecs_stage_free(job->stage);
+    ecs_os_free(job);
+    return NULL;
+  }
+  napi_create_promise(env, &job->deferred, &result);
+  napi_create_string_utf8(env, "ecs_query_exec_async", NAPI_AUTO_LENGTH,
+                          &name);
+  napi_create_async_work(env, NULL, name, queryJobExecute, queryJobComplete,
+                         job, &job->work);
+  ecs_map_init_if(&queryJobCounts, NULL);
+  ecs_map_val_t *count = ecs_map_ensure(&queryJobCounts, (uintptr_t)world);
+  if (!(*count)++)
+    ecs_readonly_begin(world, false);
+  ((query_binding_cache_t *)query->binding_ctx)->jobs++;
+  napi_queue_async_work(env, job->work);
+  return result;
+}
+
+// flecs keeps the operation list private, so the plan is parsed back from
+// the text of ecs_query_plan, whose format is only known for flecs 4.0.
+// Other versions get no operations.
+#define QUERY_PLAN_TEXT (FLECS_VERSION_MAJOR == 4 && FLECS_VERSION_MINOR == 0)
+
+// Number of operations in the query plan, which is also the length of the
+// profile array of its iterators.
+static int32_t queryOpCount(ecs_query_t *query) {
+  int32_t count = 0;
+#if QUERY_PLAN_TEXT
+  char *plan = ecs_query_plan(query);
+  for (char *ch = plan; ch && *ch; ch++)
+    count += *ch == '\n';
+  ecs_os_free(plan);
+#endif
+  return count;
+}
+
+// Writes the query plan as a JSON array, one object per VM operation.
+// `enter`/`redo` are per-operation counters, or NULL when not profiled.
+static void queryPlanJson(ecs_strbuf_t *buf, ecs_query_t *query,
+                          const int64_t *enter, const int64_t *redo) {
+  ecs_strbuf_appendch(buf, '[');
+#if QUERY_PLAN_TEXT
+  bool colors = ecs_log_enable_colors(false);
+  char *plan = ecs_query_plan(query);
+  ecs_log_enable_colors(colors);
+  int32_t count = 0;
+  for (char *line = plan; line && *line;) {
+    char *end = strchr(line, '\n');
+    if (end)
+      *end = '\0';
+    int32_t index, prev, next, n = 0;
+    if (sscanf(line, "%d. [%d, %d]%n", &index, &prev, &next, &n) == 3) {
+      char *op = line + n + 2, *args;
+      int32_t depth = 0;
+      while (*op == ' ')
+        op++, depth++;
+      for (args = op; *args && *args != ' '; args++)
+        ;
+      if (*args)
+        *args++ = '\0';
+      while (*args == ' ')
+        args++;
+      char *out = args;
+      for (char *in = args; *in; in++)
+        if (*in != ' ' || (in[1] && in[1] != ' '))
+          *out++ = *in;
+      *out = '\0';
+      char *escaped = flecs_astresc('"', args);
+      ecs_strbuf_append(buf,
+                        "%s{\"index\":%d,\"prev\":%d,\"next\":%d,"
+                        "\"op\":\"%s\",\"depth\":%d,\"args\":\"%s\"",
+                        count++ ? "," : "", index, prev, next, op, depth,
+                        escaped);
+      ecs_os_free(escaped);
+      if (enter && redo)
+        ecs_strbuf_append(buf, ",\"enter\":%lld,\"redo\":%lld",
+                          (long long)enter[index], (long long)redo[index]);
+      ecs_strbuf_appendch(buf, '}');
+    }
+    line = end ? end + 1 : NULL;
+  }
+  ecs_os_free(plan);
+#endif
+  ecs_strbuf_appendch(buf, ']');
+}
+
+static napi_value ecsQueryExplain(napi_env env, napi_callback_info info) {
+  napi_value result;
+  ecs_query_t *query;
+  napi_get_cb_info(env, info, &(size_t){0}, NULL, NULL, (void **)&query);
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  queryPlanJson(&buf, query, NULL, NULL);
+  char *str = ecs_strbuf_get(&buf);
+  napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &result);
+  ecs_os_free(str);
+  return result;
+}
+
+typedef struct query_profile_iter {
+  ecs_iter_t iter;
+  ecs_iter_fini_action_t fini;
+  int64_t *enter, *redo;
+  int32_t op_count;
+  bool counted;
+} query_profile_iter_t;
+
+// Adds the per-operation counters to the totals before flecs frees them
+// along with the iterator, which the final ecs_query_next does.
+static void queryProfileFini(ecs_iter_t *it) {
+  query_profile_iter_t *p = (query_profile_iter_t *)it;
+  const ecs_query_op_profile_t *profile = it->priv_.iter.query.profile;
+  if (profile && p->op_count) {
+    p->counted = true;
+    for (int32_t i = 0; i < p->op_count; i++) {
+      p->enter[i] += profile[i].count[0];
+      p->redo[i] += profile[i].count[1];
+    }
+  }
+  p->fini(it);
+}
+
+// Runs the query `runs` times and reports wall time per run along with how
+// often each operation was entered and redone. flecs only counts per
+// operation in debug builds; otherwise the counters are left out.
+static napi_value ecsQueryProfile(napi_env env, napi_callback_info info) {
+  napi_value result, argv[2];
+  ecs_query_t *query;
+  size_t argc = 2;
+  napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&query);
+  int32_t runs = 1;
+  if (argc >= 1 && jsType(env, argv[0]) == napi_number)
+    napi_get_value_int32(env, argv[0], &runs);
+  if (runs < 1)
+    runs = 1;
+  query_profile_iter_t p = {.op_count = queryOpCount(query)};
+  p.enter = ecs_os_calloc_n(int64_t, p.op_count + 1);
+  p.redo = ecs_os_calloc_n(int64_t, p.op_count + 1);
+  int64_t results = 0, entities = 0;
+  double total = 0, min = 0, max = 0;
+  for (int32_t r = 0; r < runs; r++) {
+    p.iter = ecs_query_iter(query->world, query);
+    ecs_iter_to_json_desc_t desc = ECS_ITER_TO_JSON_INIT;
+    if (argc == 2 &&
+        !queryExecOptions(env, argv[1], query, &p.iter, &desc)) {
+      ecs_iter_fini(&p.iter);
+      ecs_os_free(p.enter);
+      ecs_os_free(p.redo);
+      return NULL;
+    }
+    // Debug builds count without EcsIterProfile, which would also print the
+    // plan, so the counters are read from the iterator's fini.
+    p.fini = p.iter.fini;
+    p.iter.fini = queryProfileFini;
+    ecs_time_t t = {0};
+    ecs_time_measure(&t);
+    while (ecs_query_next(&p.iter)) {
+      results++;
+      entities += p.iter.count;
+    }
+    double elapsed = ecs_time_measure(&t) * 1e6;
+    total += elapsed;
+    min = !r || elapsed < min ? elapsed : min;
+    max = elapsed > max ? elapsed : max;
+  }
+  int64_t *enter = p.enter, *redo = p.redo;
+  bool counted = p.counted;
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  ecs_strbuf_append(&buf,
+                    "{\"runs\":%d,\"results\":%lld,\"entities\":%lld,"
+                    "\"time_us\":{\"avg\":%f,\"min\":%f,\"max\":%f},\"ops\":",
+                    runs, (long long)(results / runs),
+                    (long long)(entities / runs), total / runs, min, max);
+  queryPlanJson(&buf, query, counted ? enter : NULL, counted ? redo : NULL);
+  ecs_strbuf_appendch(&buf, '}');
+  ecs_os_free(enter);
+  ecs_os_free(redo);
+  char *str = ecs_strbuf_get(&buf);
+  napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &result);
+  ecs_os_free(str);
+  return result;
+}
+
+// Lists the non-empty groups of a grouped query in iteration order, with
+// the entity count from iterating it and the table counts flecs tracks.
+static napi_value ecsQueryGroups(napi_env env, napi_callback_info info) {
+  napi_value result;
+  ecs_query_t *query;
+  napi_get_cb_info(env, info, &(size_t){0}, NULL, NULL, (void **)&query);
+  query_binding_cache_t *cache = query->binding_ctx;
+  if (!cache->group_by && !cache->group_by_callback) {
+    napi_throw_error(env, NULL, "query has no group_by");
+    return NULL;
+  }
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  ecs_strbuf_appendch(&buf, '[');
+  ecs_iter_t iter = ecs_query_iter(query->world, query);
+  uint64_t group = 0;
+  int64_t entities = -1;
+  for (bool more = ecs_query_next(&iter);; more = ecs_query_next(&iter)) {
+    if (entities >= 0 && (!more || iter.group_id != group)) {
+      const ecs_query_group_info_t *group_info =
+          ecs_query_get_group_info(query, group);
+      ecs_strbuf_append(&buf,
+                        "%s{\"id\":\"%llu\",\"entities\":%lld,"
+                        "\"tables\":%d,\"matches\":%d}",
+                        ecs_strbuf_written(&buf) > 1 ? "," : "",
+                        (unsigned long long)group, (long long)entities,
+                        group_info ? group_info->table_count : 0,
+                        group_info ? group_info->match_count : 0);
+      entities = -1;
+    }
+    if (!more)
+      break;
+    if (entities < 0) {
+      group = iter.group_id;
+      entities = 0;
+    }
+    entities += iter.count;
   }
-  char *str = ecs_iter_to_json(&iter, &desc);
+  ecs_strbuf_appendch(&buf, ']');
+  char *str = ecs_strbuf_get(&buf);
   napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &result);
   ecs_os_free(str);
   return result;
@@ -248,16 +812,38 @@ static napi_value ecsQueryDispose(napi_env env, napi_callback_info info) {
   napi_value result;
   ecs_query_t *query;
   napi_get_cb_info(env, info, &(size_t){0}, NULL, NULL, (void **)&query);
+  query_binding_cache_t *cache = query->binding_ctx;
+  if (cache->jobs) {
+    napi_throw_error(env, NULL, "query has pending jobs");
+    return NULL;
+  }
+  for (int32_t i = 0; i < QUERY_BINDING_CACHE_SIZE; i++)
+    if (cache->bindings[i].query)
+      ecs_query_fini(cache->bindings[i].query);
   ecs_query_fini(query);
   napi_get_undefined(env, &result);
   return result;
 }
 
 napi_value ecs_query_expr_js(napi_env env, ecs_world_t *world,
-                             char const *expr) {
+                             char const *expr, ecs_id_t group_by,
+                             ecs_group_by_action_t group_by_callback) {
   napi_value result, fn, dispose;
-  ecs_query_t *query = ecs_query(world, {.expr = expr});
+  if (queryJobsPending(env, world))
+    return NULL;
+  query_binding_cache_t *cache = ecs_os_calloc_t(query_binding_cache_t);
+  cache->expr = ecs_os_strdup(expr);
+  cache->group_by = group_by;
+  cache->group_by_callback = group_by_callback;
+  ecs_query_t *query =
+      ecs_query(world, {.expr = expr,
+                        .group_by = group_by,
+                        .group_by_callback = group_by_callback,
+                        .binding_ctx = cache,
+                        .binding_ctx_free = queryBindingFree});
+  cache->owned = true;
   if (!query) {
+    queryBindingFree(cache);
     napi_throw_error(env, NULL, "Query failed");
     return NULL;
   }
@@ -265,6 +851,17 @@ napi_value ecs_query_expr_js(napi_env env, ecs_world_t *world,
   napi_create_object(env, &result);
   napi_create_function(env, "ecs_query_exec", 0, ecsQueryExec, query, &fn);
   napi_set_named_property(env, result, "exec", fn);
+  napi_create_function(env, "ecs_query_exec_async", 0, ecsQueryExecAsync,
+                       query, &fn);
+  napi_set_named_property(env, result, "execAsync", fn);
+  napi_create_function(env, "ecs_query_explain", 0, ecsQueryExplain, query,
+                       &fn);
+  napi_set_named_property(env, result, "explain", fn);
+  napi_create_function(env, "ecs_query_profile", 0, ecsQueryProfile, query,
+                       &fn);
+  napi_set_named_property(env, result, "profile", fn);
+  napi_create_function(env, "ecs_query_groups", 0, ecsQueryGroups, query, &fn);
+  napi_set_named_property(env, result, "groups", fn);
   napi_create_function(env, "ecs_query_dispose", 0, ecsQueryDispose, query,
                        &fn);
   napi_set_property(env, result, dispose, fn);
@@ -347,6 +944,8 @@ static napi_value evalScript(napi_env env, napi_callback_info info) {
     napi_throw_error(env, NULL, "failed to get callback info");
     return NULL;
   }
+  if (queryJobsPending(env, script->world))
+    return NULL;
   ecs_script_eval_desc_t desc = {};
   if (argc == 1) {
     desc.vars = ecs_script_vars_init(script->world);
@@ -356,7 +955,9 @@ static napi_value evalScript(napi_env env, napi_callback_info info) {
       return NULL;
     }
   }
+  ecs_os_perf_trace_push("flecs.script.eval");
   int script_result = ecs_script_eval(script, &desc);
+  ecs_os_perf_trace_pop("flecs.script.eval");
   if (desc.vars) {
     ecs_script_vars_fini(desc.vars);
   }
@@ -402,6 +1003,407 @@ napi_value ecs_script_parse_js(napi_env env, ecs_world_t *world, char *name,
   return result;
 }
 
+typedef struct script_expr {
+  ecs_world_t *world;
+  char *code;
+  ecs_script_t *script;
+  ecs_script_vars_t *vars;
+  allocpool_t pool;
+  ecs_script_runtime_t *runtime;
+} script_expr_t;
+
+static napi_status jsFromEcsValue(napi_env env, ecs_world_t *world,
+                                  const ecs_value_t *value,
+                                  napi_value *result) {
+  napi_status status;
+  const EcsPrimitive *primitive = ecs_get(world, value->type, EcsPrimitive);
+  ecs_primitive_kind_t kind = primitive ? primitive->kind : EcsEntity;
+  if (kind == EcsBool)
+    return napi_get_boolean(env, *(bool *)value->ptr, result);
+  if (kind == EcsString) {
+    const char *str = *(char **)value->ptr;
+    return str ? napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, result)
+               : napi_get_null(env, result);
+  }
+  if (kind != EcsEntity && kind != EcsId && kind != EcsChar) {
+    ecs_meta_cursor_t cur = ecs_meta_cursor(world, value->type, value->ptr);
+    return napi_create_double(env, ecs_meta_get_float(&cur), result);
+  }
+  napi_value json, parse, str;
+  char *text = ecs_ptr_to_json(world, value->type, value->ptr);
+  if (!text)
+    return napi_generic_failure;
+  status = napi_create_string_utf8(env, text, NAPI_AUTO_LENGTH, &str);
+  ecs_os_free(text);
+  if (status != napi_ok)
+    return status;
+  TRY0(napi_get_global(env, &json));
+  TRY0(napi_get_named_property(env, json, "JSON", &json));
+  TRY0(napi_get_named_property(env, json, "parse", &parse));
+  return napi_call_function(env, json, parse, 1, &str, result);
+}
+
+// Variables are typed by the parser, so an expression is parsed on its first
+// eval with the variables passed there. Later evals must keep their types.
+static bool exprVarsMatch(script_expr_t *expr, ecs_script_vars_t *vars) {
+  ecs_script_var_t *var = ecs_vec_first(&vars->vars);
+  for (int32_t i = 0; i < ecs_vec_count(&vars->vars); i++) {
+    ecs_script_var_t *prev = ecs_script_vars_lookup(expr->vars, var[i].name);
+    if (prev && prev->value.type != var[i].value.type)
+      return false;
+  }
+  return true;
+}
+
+static napi_value evalExpr(napi_env env, napi_callback_info info) {
+  allocpool_t pool = NULL;
+  napi_value result = NULL;
+  script_expr_t *expr;
+  size_t argc = 1;
+  napi_value vars;
+  if (napi_get_cb_info(env, info, &argc, &vars, NULL, (void **)&expr)) {
+    napi_throw_error(env, NULL, "failed to get callback info");
+    return NULL;
+  }
+  ecs_script_vars_t *ecs_vars = ecs_script_vars_init(expr->world);
+  if (argc == 1) {
+    napi_status status = jsObjectToEcsVars(env, ecs_vars, vars, &pool);
+    if (status != napi_ok) {
+      napi_throw_error(env, NULL, "failed to convert flecs vars");
+      goto done;
+    }
+  }
+  if (!expr->script) {
+    ecs_expr_eval_desc_t desc = {.vars = ecs_vars};
+    expr->script = ecs_expr_parse(expr->world, expr->code, &desc);
+    if (!expr->script) {
+      napi_throw_error(env, NULL, "failed to parse expression");
+      goto done;
+    }
+    expr->vars = ecs_vars;
+    expr->pool = pool;
+    ecs_vars = NULL;
+    pool = NULL;
+  } else if (!exprVarsMatch(expr, ecs_vars)) {
+    napi_throw_error(env, NULL, "variable type differs from first eval");
+    goto done;
+  }
+  ecs_expr_eval_desc_t desc = {
+      .vars = ecs_vars ? ecs_vars : expr->vars, .runtime = expr->runtime};
+  ecs_value_t value = {0};
+  if (ecs_expr_eval(expr->script, &value, &desc)) {
+    napi_throw_error(env, NULL, "eval error");
+    goto done;
+  }
+  if (jsFromEcsValue(env, expr->world, &value, &result) != napi_ok)
+    napi_throw_error(env, NULL, "failed to convert result");
+  ecs_value_free(expr->world, value.type, value.ptr);
+done:
+  if (ecs_vars)
+    ecs_script_vars_fini(ecs_vars);
+  if (pool)
+    allocpool_fini(pool);
+  return result;
+}
+
+static napi_value disposeExpr(napi_env env, napi_callback_info info) {
+  napi_value result;
+  script_expr_t *expr;
+  if (napi_get_cb_info(env, info, &(size_t){0}, NULL, NULL, (void **)&expr)) {
+    napi_throw_error(env, NULL, "failed to get callback info");
+    return NULL;
+  }
+  if (expr->script) {
+    ecs_script_free(expr->script);
+    ecs_script_vars_fini(expr->vars);
+  }
+  if (expr->pool)
+    allocpool_fini(expr->pool);
+  ecs_script_runtime_free(expr->runtime);
+  ecs_os_free(expr->code);
+  ecs_os_free(expr);
+  napi_get_undefined(env, &result);
+  return result;
+}
+
+// Parses and constant-folds an expression once. Every eval reuses the tree
+// and a private runtime, so repeated evaluation skips the parser and the
+// runtime's stack allocation.
+napi_value ecs_expr_parse_js(napi_env env, ecs_world_t *world, char *code) {
+  napi_value result, dispose, fn;
+  script_expr_t *expr = ecs_os_calloc_t(script_expr_t);
+  expr->world = world;
+  expr->code = ecs_os_strdup(code);
+  expr->runtime = ecs_script_runtime_new();
+  if (napi_create_object(env, &result) || jsSymbolDispose(env, &dispose) ||
+      napi_create_function(env, "eval", 1, evalExpr, expr, &fn) ||
+      napi_set_named_property(env, result, "eval", fn) ||
+      napi_create_function(env, "dispose", 1, disposeExpr, expr, &fn) ||
+      napi_set_property(env, result, dispose, fn) != napi_ok) {
+    napi_throw_error(env, NULL, "failed to create object");
+    return NULL;
+  }
+  return result;
+}
+
+static ecs_entity_t remapEntity(ecs_map_t *remap, ecs_entity_t e) {
+  ecs_map_val_t *real = ecs_map_get(remap, e);
+  return real ? *real : e;
+}
+
+static ecs_id_t remapId(ecs_world_t *world, ecs_map_t *remap, ecs_id_t id) {
+  if (ECS_IS_PAIR(id))
+    return ecs_pair(remapEntity(remap, ecs_pair_first(world, id)),
+                    remapEntity(remap, ecs_pair_second(world, id)));
+  return (id & ECS_ID_FLAGS_MASK) |
+         remapEntity(remap, id & ECS_COMPONENT_MASK);
+}
+
+// Rewrites entity and id members that point into the shadow tree. Members
+// of inline struct arrays and vectors are left as they are.
+static void remapValue(ecs_world_t *world, ecs_map_t *remap,
+                       ecs_entity_t type, void *ptr) {
+  const EcsTypeSerializer *ser = ecs_get(world, type, EcsTypeSerializer);
+  if (!ser)
+    return;
+  ecs_meta_type_op_t *ops = ecs_vec_first(&ser->ops);
+  for (int32_t i = 0; i < ecs_vec_count(&ser->ops); i++) {
+    ecs_meta_type_op_t *op = &ops[i];
+    int32_t count = op->count > 1 ? op->count : 1;
+    if (op->kind == EcsOpEntity || op->kind == EcsOpId) {
+      for (int32_t j = 0; j < count; j++) {
+        ecs_id_t *id = ECS_OFFSET(ptr, op->offset + j * op->size);
+        *id = op->kind == EcsOpEntity ? remapEntity(remap, *id)
+                                      : remapId(world, remap, *id);
+      }
+    } else if (count > 1) {
+      i += op->op_count - 1;
+    }
+  }
+}
+
+static bool shadowSkipsId(ecs_id_t id) {
+  return id == EcsDisabled || ECS_HAS_RELATION(id, EcsChildOf) ||
+         id == ecs_pair(ecs_id(EcsIdentifier), EcsName);
+}
+
+// Moves the real entity to the ids and values of its shadow counterpart.
+// Values are only written when they differ, so unchanged components get no
+// OnSet and unchanged entities no table move.
+static void shadowApply(ecs_world_t *world, ecs_map_t *remap,
+                        ecs_entity_t shadow, ecs_entity_t real,
+                        ecs_id_t tag) {
+  const ecs_type_t *type = ecs_get_type(world, shadow);
+  ecs_vec_t wanted;
+  ecs_vec_init_t(NULL, &wanted, ecs_id_t, type->count);
+  for (int32_t i = 0; i < type->count; i++)
+    if (!shadowSkipsId(type->array[i]))
+      *ecs_vec_append_t(NULL, &wanted, ecs_id_t) =
+          remapId(world, remap, type->array[i]);
+  ecs_id_t *ids = ecs_vec_first(&wanted);
+  int32_t count = ecs_vec_count(&wanted);
+
+  if (ecs_has_id(world, real, tag)) {
+    const ecs_type_t *old = ecs_get_type(world, real);
+    ecs_id_t *stale = ecs_os_alloca_n(ecs_id_t, old->count);
+    int32_t stale_count = 0;
+    for (int32_t i = 0; i < old->count; i++) {
+      ecs_id_t id = old->array[i];
+      bool keep = id == tag || shadowSkipsId(id);
+      for (int32_t j = 0; !keep && j < count; j++)
+        keep = ids[j] == id;
+      if (!keep)
+        stale[stale_count++] = id;
+    }
+    for (int32_t i = 0; i < stale_count; i++)
+      ecs_remove_id(world, real, stale[i]);
+  }
+
+  for (int32_t i = 0, j = 0; i < type->count; i++) {
+    ecs_id_t src = type->array[i];
+    if (shadowSkipsId(src))
+      continue;
+    ecs_id_t id = ids[j++];
+    ecs_entity_t typeid = ecs_get_typeid(world, src);
+    if (!typeid) {
+      ecs_add_id(world, real, id);
+      continue;
+    }
+    const ecs_type_info_t *ti = ecs_get_type_info(world, typeid);
+    void *value = ecs_value_new_w_type_info(world, ti);
+    const void *src_value = ecs_get_id(world, shadow, src);
+    ecs_value_copy_w_type_info(world, ti, value, src_value);
+    remapValue(world, remap, typeid, value);
+    const void *prev = ecs_get_id(world, real, id);
+    bool changed = !prev;
+    if (prev && !ti->hooks.copy) {
+      changed = memcmp(prev, value, ti->size) != 0;
+    } else if (prev) {
+      char *a = ecs_ptr_to_json(world, typeid, prev);
+      char *b = ecs_ptr_to_json(world, typeid, value);
+      changed = !a || !b || strcmp(a, b);
+      ecs_os_free(a);
+      ecs_os_free(b);
+    }
+    if (changed)
+      ecs_set_id(world, real, id, ti->size, value);
+    ecs_value_free(world, typeid, value);
+  }
+  ecs_vec_fini_t(NULL, &wanted, ecs_id_t);
+}
+
+// Collects the shadow tree parents-first. Children created by prefab or
+// template instantiation are left out: flecs rebuilds those on the real side.
+static bool shadowCollect(ecs_world_t *world, ecs_entity_t parent,
+                          ecs_vec_t *out) {
+  int32_t start = ecs_vec_count(out);
+  ecs_iter_t it = ecs_children(world, parent);
+  while (ecs_children_next(&it)) {
+    if (!ecs_table_has_id(world, it.table, EcsDisabled) ||
+        ecs_table_has_id(world, it.table,
+                         ecs_pair(EcsScriptTemplate, EcsWildcard)))
+      continue;
+    if (ecs_table_has_id(world, it.table, ecs_id(EcsComponent))) {
+      ecs_iter_fini(&it);
+      return false;
+    }
+    for (int32_t i = 0; i < it.count; i++)
+      *ecs_vec_append_t(NULL, out, ecs_entity_t) = it.entities[i];
+  }
+  int32_t end = ecs_vec_count(out);
+  for (int32_t i = start; i < end; i++) {
+    ecs_entity_t e = *ecs_vec_get_t(out, ecs_entity_t, i);
+    if (!shadowCollect(world, e, out))
+      return false;
+  }
+  return true;
+}
+
+// Whether a parsed script names Disabled, which the shadow tree below already
+// uses to hide itself. Identifiers are read from the syntax tree, so comments
+// do not count, and resolved like the script resolves them, so full paths do.
+static bool scriptUsesDisabled(ecs_world_t *world, ecs_script_t *script) {
+  char *ast = ecs_script_ast_to_str(script, false);
+  if (!ast)
+    return true;
+  bool found = false;
+  for (char *p = ast; *p && !found;) {
+    size_t len = strspn(p, "abcdefghijklmnopqrstuvwxyz"
+                           "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.");
+    if (!len) {
+      p++;
+      continue;
+    }
+    char end = p[len];
+    p[len] = '\0';
+    found = (isalpha((uint8_t)*p) || *p == '_') &&
+            ecs_lookup(world, p) == EcsDisabled;
+    p[len] = end;
+    p += len;
+  }
+  ecs_os_free(ast);
+  return found;
+}
+
+// Updates a script by evaluating the new code into a shadow tree and applying
+// the difference to the entities the script created before. Shadow entities
+// are disabled, which hides them from queries and observers. Named entities
+// keep their ids and unchanged components are not touched. Scripts that
+// define components or templates, or use Disabled themselves, fall back to
+// ecs_script_update.
+static int scriptUpdateIncremental(ecs_world_t *world, ecs_entity_t script,
+                                   const char *code) {
+  if (ecs_is_deferred(world))
+    return ecs_script_update(world, script, 0, code);
+  const EcsScript *prev = ecs_get(world, script, EcsScript);
+  if (prev && prev->template_)
+    return ecs_script_update(world, script, 0, code);
+  ecs_script_t *parsed =
+      ecs_script_parse(world, ecs_get_name(world, script), code, NULL);
+  if (!parsed)
+    return -1;
+  if (scriptUsesDisabled(world, parsed)) {
+    ecs_script_free(parsed);
+    return ecs_script_update(world, script, 0, code);
+  }
+
+  ecs_entity_t root = ecs_get_scope(world);
+  ecs_entity_t shadow = ecs_new_w_id(world, EcsDisabled);
+  ecs_set_scope(world, shadow);
+  ecs_id_t prev_with = ecs_set_with(world, EcsDisabled);
+  int result = ecs_script_eval(parsed, NULL);
+  ecs_set_with(world, prev_with);
+  ecs_set_scope(world, root);
+
+  ecs_vec_t order;
+  ecs_vec_init_t(NULL, &order, ecs_entity_t, 0);
+  if (result || !shadowCollect(world, shadow, &order)) {
+    ecs_vec_fini_t(NULL, &order, ecs_entity_t);
+    ecs_delete(world, shadow);
+    ecs_script_free(parsed);
+    return result ? -1 : ecs_script_update(world, script, 0, code);
+  }
+
+  ecs_id_t tag = ecs_pair_t(EcsScript, script);
+  ecs_map_t remap, kept;
+  ecs_map_init(&remap, NULL);
+  ecs_map_init(&kept, NULL);
+  ecs_entity_t *shadows = ecs_vec_first(&order);
+  int32_t count = ecs_vec_count(&order);
+  for (int32_t i = 0; i < count; i++) {
+    ecs_entity_t parent = ecs_get_parent(world, shadows[i]);
+    parent = parent == shadow ? root : remapEntity(&remap, parent);
+    const char *name = ecs_get_name(world, shadows[i]);
+    ecs_entity_t real = name ? ecs_lookup_child(world, parent, name) : 0;
+    if (!real)
+      real = ecs_entity(world, {.name = name,
+                                .parent = parent,
+                                .add = (ecs_id_t[]){tag, 0}});
+    *ecs_map_ensure(&remap, shadows[i]) = real;
+    ecs_map_ensure(&kept, real);
+  }
+  for (int32_t i = 0; i < count; i++)
+    shadowApply(world, &remap, shadows[i], remapEntity(&remap, shadows[i]),
+                tag);
+
+  ecs_vec_clear(&order);
+  ecs_iter_t it = ecs_each_id(world, tag);
+  while (ecs_each_next(&it)) {
+    if (ecs_table_has_id(world, it.table,
+                         ecs_pair(EcsScriptTemplate, EcsWildcard)))
+      continue;
+    for (int32_t i = 0; i < it.count; i++)
+      if (!ecs_map_get(&kept, it.entities[i]))
+        *ecs_vec_append_t(NULL, &order, ecs_entity_t) = it.entities[i];
+  }
+  ecs_entity_t *stale = ecs_vec_first(&order);
+  for (int32_t i = 0; i < ecs_vec_count(&order); i++)
+    if (ecs_is_alive(world, stale[i]))
+      ecs_delete(world, stale[i]);
+
+  ecs_map_fini(&remap);
+  ecs_map_fini(&kept);
+  ecs_vec_fini_t(NULL, &order, ecs_entity_t);
+  ecs_delete(world, shadow);
+
+  EcsScript *s = ecs_ensure(world, script, EcsScript);
+  if (s->script)
+    ecs_script_free(s->script);
+  s->script = parsed;
+  return 0;
+}
+
+int ecs_script_update_code(ecs_world_t *world, ecs_entity_t script,
+                           ecs_entity_t template, const char *code,
+                           bool incremental) {
+  ecs_os_perf_trace_push("flecs.script.eval");
+  int result = incremental && !template
+                   ? scriptUpdateIncremental(world, script, code)
+                   : ecs_script_update(world, script, template, code);
+  ecs_os_perf_trace_pop("flecs.script.eval");
+  return result;
+}
+
 napi_value ecs_world_to_json_js(napi_env env, ecs_world_t *world) {
   ecs_world_to_json_desc_t desc = {};
   char *json = ecs_world_to_json(world, &desc);
@@ -410,3 +1412,2478 @@ napi_value ecs_world_to_json_js(napi_env env, ecs_world_t *world) {
   ecs_os_free(json);
   return result;
 }
+
+static const char *jsonWs(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
+  return p;
+}
+
+static const char *jsonSkipString(const char *p) {
+  for (;;) {
+    const char *quote = strchr(p, '"'), *escape = quote;
+    if (!quote)
+      return NULL;
+    while (escape > p && escape[-1] == '\\')
+      escape--;
+    if (!((quote - escape) & 1))
+      return quote + 1;
+    p = quote + 1;
+  }
+}
+
+// Skips one value, jumping between structural characters with strcspn so
+// that component bodies are never tokenized on this path.
+static const char *jsonSkipValue(const char *p) {
+  int depth = 0;
+  p = jsonWs(p);
+  if (*p != '"' && *p != '{' && *p != '[')
+    return p + strcspn(p, ",:}] \t\r\n");
+  do {
+    p += strcspn(p, "\"{}[]");
+    switch (*p) {
+    case '"':
+      if (!(p = jsonSkipString(p + 1)))
+        return NULL;
+      break;
+    case '{':
+    case '[':
+      depth++, p++;
+      break;
+    case '}':
+    case ']':
+      depth--, p++;
+      break;
+    default:
+      return NULL;
+    }
+  } while (depth > 0);
+  return p;
+}
+
+static const char *jsonString(const char *p, char **pbuf, size_t *psize) {
+  p = jsonWs(p);
+  if (*p != '"')
+    return NULL;
+  const char *end = jsonSkipString(++p);
+  if (!end)
+    return NULL;
+  if ((size_t)(end - p) > *psize) {
+    *psize = nextsize(end - p, 256);
+    *pbuf = ecs_os_realloc(*pbuf, *psize);
+  }
+  char *out = *pbuf;
+  for (; p < end - 1; p++) {
+    if (*p != '\\') {
+      *out++ = *p;
+      continue;
+    }
+    switch (*++p) {
+    case 'b':
+      *out++ = '\b';
+      break;
+    case 'f':
+      *out++ = '\f';
+      break;
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'u': {
+      char hex[5] = {0};
+      memcpy(hex, p + 1, 4);
+      unsigned long cp = strtoul(hex, NULL, 16);
+      p += 4;
+      // Characters outside the BMP arrive as a high and a low surrogate,
+      // which encode as one 4-byte sequence.
+      if (cp >= 0xD800 && cp < 0xDC00 && p + 7 < end && p[1] == '\\' &&
+          p[2] == 'u') {
+        memcpy(hex, p + 3, 4);
+        unsigned long low = strtoul(hex, NULL, 16);
+        if (low >= 0xDC00 && low < 0xE000) {
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          p += 6;
+        }
+      }
+      if (cp < 0x80) {
+        *out++ = (char)cp;
+      } else if (cp < 0x800) {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+      } else if (cp < 0x10000) {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+      } else {
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+      }
+    } break;
+    default:
+      *out++ = *p;
+      break;
+    }
+  }
+  *out = 0;
+  return end;
+}
+
+static const char *jsonExpect(const char *p, char c) {
+  p = jsonWs(p);
+  return *p == c ? p + 1 : NULL;
+}
+
+static void jsonMarkReserved(ecs_map_t *anonymous, ecs_entity_t e) {
+  *ecs_map_ensure(anonymous, e) = 0;
+}
+
+static ecs_entity_t jsonNewId(ecs_world_t *world, ecs_entity_t ser_id) {
+  return ser_id < FLECS_HI_COMPONENT_ID ? ecs_new_low_id(world)
+                                        : ecs_new(world);
+}
+
+// Same id mapping rules as the lookup used by ecs_world_from_json, so that
+// both passes of the bulk loader agree on anonymous entities.
+static ecs_entity_t jsonEnsureEntity(ecs_world_t *world, const char *name,
+                                     ecs_map_t *anonymous) {
+  ecs_entity_t e;
+  if (name[0] == '#' && name[1] >= '0' && name[1] <= '9' &&
+      !name[1 + strspn(name + 1, "0123456789")]) {
+    ecs_entity_t ser_id = strtoull(name + 1, NULL, 10);
+    ecs_map_val_t *deser_id = ecs_map_get(anonymous, ser_id);
+    if (deser_id) {
+      if (!(e = *deser_id)) {
+        e = *deser_id = jsonNewId(world, ser_id);
+        jsonMarkReserved(anonymous, e);
+      }
+    } else if (!ecs_exists(world, ser_id) ||
+               (ecs_is_alive(world, ser_id) && !ecs_get_name(world, ser_id))) {
+      *ecs_map_ensure(anonymous, ser_id) = e = ser_id;
+      ecs_make_alive(world, ser_id);
+    } else {
+      *ecs_map_ensure(anonymous, ser_id) = e = jsonNewId(world, ser_id);
+      jsonMarkReserved(anonymous, e);
+    }
+    return e;
+  }
+  e = ecs_lookup_path_w_sep(world, 0, name, ".", NULL, false);
+  if (!e) {
+    e = ecs_entity(world, {.name = name});
+    jsonMarkReserved(anonymous, e);
+  }
+  return e;
+}
+
+#define BULK_NAME_CACHE_SIZE 256
+
+typedef struct bulk_name {
+  uint64_t hash;
+  char *name;
+  ecs_entity_t entity;
+} bulk_name_t;
+
+typedef struct bulk_value {
+  ecs_id_t id;
+  const char *json;
+} bulk_value_t;
+
+typedef struct bulk_entity {
+  const char *json;
+  ecs_entity_t entity;
+  ecs_table_t *table;
+  int32_t value, value_count;
+  bool full;
+} bulk_entity_t;
+
+typedef struct bulk_loader {
+  ecs_world_t *world;
+  bulk_name_t names[BULK_NAME_CACHE_SIZE];
+  ecs_from_json_desc_t desc;
+  ecs_map_t anonymous;
+  char *buf, *name;
+  size_t bufsize, namesize;
+  ecs_entity_t meta;
+  bool schema;
+  ecs_id_t *ids;
+  int32_t ids_count, ids_size;
+  bulk_value_t *values;
+  int32_t values_count, values_size;
+} bulk_loader_t;
+
+
+
+// Tags, relationships and component names repeat across most entities of a
+// dump, so root-scoped paths are memoized instead of parsed on every use.
+static ecs_entity_t bulkLookupAction(const ecs_world_t *cworld,
+                                     const char *name, void *ctx) {
+  ecs_world_t *world = (ecs_world_t *)cworld;
+  bulk_loader_t *loader = ctx;
+  if (name[0] == '#' || ecs_get_scope(world))
+    return jsonEnsureEntity(world, name, &loader->anonymous);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const char *c = name; *c; c++)
+    hash = (hash ^ (uint8_t)*c) * 0x100000001b3ull;
+  bulk_name_t *slot = &loader->names[hash % BULK_NAME_CACHE_SIZE];
+  if (slot->name && slot->hash == hash && !strcmp(slot->name, name) &&
+      ecs_is_alive(world, slot->entity))
+    return slot->entity;
+  ecs_os_free(slot->name);
+  slot->hash = hash;
+  slot->name = ecs_os_strdup(name);
+  return slot->entity = jsonEnsureEntity(world, name, &loader->anonymous);
+}
+
+static ecs_entity_t bulkLookup(bulk_loader_t *loader, const char *name,
+                               ecs_entity_t parent) {
+  ecs_entity_t scope = parent ? ecs_set_scope(loader->world, parent) : 0;
+  ecs_entity_t e = bulkLookupAction(loader->world, name, loader);
+  if (parent)
+    ecs_set_scope(loader->world, scope);
+  return e;
+}
+
+static void bulkPushId(bulk_loader_t *loader, ecs_id_t id) {
+  if (loader->ids_count == loader->ids_size) {
+    loader->ids_size = loader->ids_size ? loader->ids_size * 2 : 32;
+    loader->ids = ecs_os_realloc_n(loader->ids, ecs_id_t, loader->ids_size);
+  }
+  loader->ids[loader->ids_count++] = id;
+}
+
+// Entities carrying reflection data define the types later entities are
+// built from, so they must be loaded in document order, before any table
+// that uses them is created.
+static void bulkAddId(bulk_loader_t *loader, ecs_id_t id) {
+  ecs_entity_t first = ECS_IS_PAIR(id) ? ECS_PAIR_FIRST(id) : id;
+  if (first == ecs_id(EcsComponent) ||
+      (loader->meta && ecs_get_parent(loader->world, first) == loader->meta))
+    loader->schema = true;
+  bulkPushId(loader, id);
+}
+
+static void bulkPushValue(bulk_loader_t *loader, ecs_id_t id,
+                          const char *json) {
+  if (loader->values_count == loader->values_size) {
+    loader->values_size = loader->values_size ? loader->values_size * 2 : 256;
+    loader->values =
+        ecs_os_realloc_n(loader->values, bulk_value_t, loader->values_size);
+  }
+  loader->values[loader->values_count++] = (bulk_value_t){id, json};
+}
+
+static int bulkIdCompare(const void *a, const void *b) {
+  ecs_id_t l = *(const ecs_id_t *)a, r = *(const ecs_id_t *)b;
+  return (l > r) - (l < r);
+}
+
+static ecs_id_t bulkComponentId(bulk_loader_t *loader) {
+  char *key = loader->buf;
+  if (key[0] != '(')
+    return bulkLookup(loader, key, 0);
+  size_t len = strlen(key);
+  char *comma = strchr(key, ',');
+  if (!comma || key[len - 1] != ')')
+    return 0;
+  key[len - 1] = 0;
+  *comma = 0;
+  ecs_entity_t rel = bulkLookup(loader, key + 1, 0);
+  ecs_entity_t tgt = bulkLookup(loader, comma + 1 + strspn(comma + 1, " "), 0);
+  return ecs_pair(rel, tgt);
+}
+
+// First pass over one entity object: resolve the entity and collect every id
+// it will end up with, without touching any component values.
+static const char *bulkScanEntity(bulk_loader_t *loader, const char *p,
+                                  bulk_entity_t *out) {
+  ecs_world_t *world = loader->world;
+  ecs_entity_t parent = 0, e = 0;
+  bool named = false, numbered = false;
+  uint32_t number = 0;
+  loader->ids_count = 0;
+  out->entity = 0;
+  out->value = loader->values_count;
+  out->full = false;
+  loader->schema = false;
+  if (!(p = jsonExpect(p, '{')))
+    return NULL;
+  if (*jsonWs(p) == '}')
+    return jsonWs(p) + 1;
+  do {
+    if (!(p = jsonString(p, &loader->buf, &loader->bufsize)) ||
+        !(p = jsonExpect(p, ':')))
+      return NULL;
+    if (!strcmp(loader->buf, "parent")) {
+      if (!(p = jsonString(p, &loader->buf, &loader->bufsize)))
+        return NULL;
+      parent = bulkLookup(loader, loader->buf, 0);
+      bulkPushId(loader, ecs_pair(EcsChildOf, parent));
+    } else if (!strcmp(loader->buf, "name")) {
+      if (!(p = jsonString(p, &loader->name, &loader->namesize)))
+        return NULL;
+      named = true;
+    } else if (!strcmp(loader->buf, "id")) {
+      p = jsonWs(p);
+      number = (uint32_t)strtoull(p, NULL, 10);
+      numbered = true;
+      if (!(p = jsonSkipValue(p)))
+        return NULL;
+    } else if (!strcmp(loader->buf, "tags")) {
+      if (!(p = jsonExpect(p, '[')))
+        return NULL;
+      if (*jsonWs(p) == ']')
+        p = jsonWs(p) + 1;
+      else
+        do {
+          if (!(p = jsonString(p, &loader->buf, &loader->bufsize)))
+            return NULL;
+          bulkAddId(loader, bulkLookup(loader, loader->buf, 0));
+          p = jsonWs(p);
+        } while (*p++ == ',');
+      if (p[-1] != ']')
+        return NULL;
+    } else if (!strcmp(loader->buf, "pairs")) {
+      if (!(p = jsonExpect(p, '{')))
+        return NULL;
+      if (*jsonWs(p) == '}')
+        p = jsonWs(p) + 1;
+      else
+        do {
+          if (!(p = jsonString(p, &loader->buf, &loader->bufsize)) ||
+              !(p = jsonExpect(p, ':')))
+            return NULL;
+          ecs_entity_t rel = bulkLookup(loader, loader->buf, 0);
+          bool multiple = *(p = jsonWs(p)) == '[';
+          if (multiple)
+            p++;
+          do {
+            if (!(p = jsonString(p, &loader->buf, &loader->bufsize)))
+              return NULL;
+            ecs_entity_t tgt = bulkLookup(loader, loader->buf, 0);
+            bulkAddId(loader, ecs_pair(rel, tgt));
+            p = jsonWs(p);
+          } while (multiple && *p++ == ',');
+          if (multiple && p[-1] != ']')
+            return NULL;
+          p = jsonWs(p);
+        } while (*p++ == ',');
+      if (p[-1] != '}')
+        return NULL;
+    } else if (!strcmp(loader->buf, "components")) {
+      if (!(p = jsonExpect(p, '{')))
+        return NULL;
+      if (*jsonWs(p) == '}')
+        p = jsonWs(p) + 1;
+      else
+        do {
+          if (!(p = jsonString(p, &loader->buf, &loader->bufsize)) ||
+              !(p = jsonExpect(p, ':')))
+            return NULL;
+          ecs_id_t id = bulkComponentId(loader);
+          if (!id)
+            return NULL;
+          // Entities with values for components that are not registered yet
+          // go through ecs_entity_from_json, which adds them once known.
+          p = jsonWs(p);
+          bool identifier =
+              ECS_IS_PAIR(id) && ECS_PAIR_FIRST(id) == ecs_id(EcsIdentifier);
+          if (identifier || !strncmp(p, "null", 4)) {
+            if (id != ecs_pair(ecs_id(EcsIdentifier), EcsName))
+              bulkAddId(loader, id);
+          } else if (ecs_get_typeid(world, id)) {
+            bulkAddId(loader, id);
+            bulkPushValue(loader, id, p);
+          } else {
+            out->full = true;
+          }
+          if (!(p = jsonSkipValue(p)))
+            return NULL;
+          p = jsonWs(p);
+        } while (*p++ == ',');
+      if (p[-1] != '}')
+        return NULL;
+    } else if (!(p = jsonSkipValue(p))) {
+      return NULL;
+    }
+    p = jsonWs(p);
+  } while (*p++ == ',');
+  if (p[-1] != '}')
+    return NULL;
+  // Resolved once the whole object is read, so that "name" is looked up
+  // under "parent" wherever the keys appear, and wins over "id".
+  if (named) {
+    e = bulkLookup(loader, loader->name, parent);
+  } else if (numbered) {
+    snprintf(loader->buf, loader->bufsize, "#%u", number);
+    e = bulkLookup(loader, loader->buf, 0);
+  }
+  if (!e)
+    return NULL;
+  if (loader->schema) {
+    loader->values_count = out->value;
+    return ecs_entity_from_json(world, e, out->json, &loader->desc) ? p : NULL;
+  }
+  out->entity = e;
+  out->value_count = loader->values_count - out->value;
+  out->table = NULL;
+  if (loader->ids_count) {
+    if (ecs_get_name(world, e))
+      bulkPushId(loader, ecs_pair(ecs_id(EcsIdentifier), EcsName));
+    qsort(loader->ids, loader->ids_count, sizeof(ecs_id_t), bulkIdCompare);
+    int32_t count = 0;
+    for (int32_t i = 0; i < loader->ids_count; i++)
+      if (!count || loader->ids[count - 1] != loader->ids[i])
+        loader->ids[count++] = loader->ids[i];
+    out->table = ecs_table_find(world, loader->ids, count);
+  }
+  return p;
+}
+
+static int bulkEntityCompare(const void *a, const void *b) {
+  const bulk_entity_t *l = a, *r = b;
+  if (l->table != r->table)
+    return (uintptr_t)l->table < (uintptr_t)r->table ? -1 : 1;
+  return (l->json > r->json) - (l->json < r->json);
+}
+
+// Moves an entity straight into the table found by the scan. Entities that
+// gained ids in the meantime are loaded with ecs_entity_from_json instead.
+static void bulkCommit(bulk_loader_t *loader, bulk_entity_t *entity) {
+  ecs_table_t *src = ecs_get_table(loader->world, entity->entity);
+  if (!entity->table || src == entity->table)
+    return;
+  const ecs_type_t *dst_type = ecs_table_get_type(entity->table);
+  const ecs_type_t *src_type = src ? ecs_table_get_type(src) : NULL;
+  int32_t i = 0, i_src = 0, src_count = src_type ? src_type->count : 0;
+  loader->ids_count = 0;
+  for (; i < dst_type->count; i++) {
+    if (i_src < src_count && src_type->array[i_src] < dst_type->array[i]) {
+      entity->full = true;
+      return;
+    }
+    if (i_src < src_count && src_type->array[i_src] == dst_type->array[i])
+      i_src++;
+    else
+      bulkPushId(loader, dst_type->array[i]);
+  }
+  if (i_src < src_count) {
+    entity->full = true;
+    return;
+  }
+  ecs_type_t added = {.array = loader->ids, .count = loader->ids_count};
+  ecs_commit(loader->world, entity->entity, NULL, entity->table, &added, NULL);
+}
+
+char const *ecs_world_from_json_bulk(ecs_world_t *world, char const *json) {
+  bulk_loader_t loader = {.world = world};
+  bulk_entity_t *entities = NULL;
+  int32_t count = 0, size = 0;
+  const char *p = json;
+  ecs_map_init(&loader.anonymous, NULL);
+  loader.desc.name = "<json>";
+  loader.desc.lookup_action = bulkLookupAction;
+  loader.desc.lookup_ctx = &loader;
+  loader.meta = ecs_lookup(world, "flecs.meta");
+
+  if (!(p = jsonExpect(p, '{')) ||
+      !(p = jsonString(p, &loader.buf, &loader.bufsize)) ||
+      strcmp(loader.buf, "results") || !(p = jsonExpect(p, ':')) ||
+      !(p = jsonExpect(p, '[')))
+    goto error;
+  if (*jsonWs(p) == ']')
+    p = jsonWs(p) + 1;
+  else
+    do {
+      if (count == size) {
+        size = size ? size * 2 : 256;
+        entities = ecs_os_realloc_n(entities, bulk_entity_t, size);
+      }
+      entities[count].json = jsonWs(p);
+      if (!(p = bulkScanEntity(&loader, p, &entities[count])))
+        goto error;
+      if (entities[count].entity)
+        count++;
+      p = jsonWs(p);
+    } while (*p++ == ',');
+  if (p[-1] != ']' || !(p = jsonExpect(p, '}')))
+    goto error;
+
+  // Group by destination table so every table is filled in one run, then
+  // deserialize values into entities that already have their final type.
+  qsort(entities, count, sizeof(bulk_entity_t), bulkEntityCompare);
+  for (int32_t i = 0; i < count; i++)
+    bulkCommit(&loader, &entities[i]);
+  for (int32_t i = 0; i < count; i++) {
+    bulk_entity_t *entity = &entities[i];
+    if (entity->full) {
+      if (!ecs_entity_from_json(world, entity->entity, entity->json,
+                                &loader.desc))
+        goto error;
+      continue;
+    }
+    bulk_value_t *value = &loader.values[entity->value];
+    for (int32_t v = 0; v < entity->value_count; v++, value++) {
+      ecs_entity_t type = ecs_get_typeid(world, value->id);
+      void *ptr = ecs_ensure_id(world, entity->entity, value->id);
+      if (!ecs_ptr_from_json(world, type, ptr, value->json, &loader.desc)) {
+        char *id = ecs_id_str(world, value->id);
+        char *path = ecs_get_path(world, entity->entity);
+        ecs_parser_error(NULL, json, value->json - json,
+                         "invalid value for %s of %s", id, path);
+        ecs_os_free(id);
+        ecs_os_free(path);
+        p = NULL;
+        goto error;
+      }
+      ecs_modified_id(world, entity->entity, value->id);
+    }
+  }
+  goto done;
+error:
+  if (p)
+    ecs_parser_error(NULL, json, p - json, "invalid world json");
+  p = NULL;
+done:
+  ecs_map_fini(&loader.anonymous);
+  for (int32_t i = 0; i < BULK_NAME_CACHE_SIZE; i++)
+    ecs_os_free(loader.names[i].name);
+  ecs_os_free(entities);
+  ecs_os_free(loader.ids);
+  ecs_os_free(loader.values);
+  ecs_os_free(loader.buf);
+  ecs_os_free(loader.name);
+  return p;
+}
+
+typedef struct world_stats {
+  ecs_world_stats_t world;
+  ecs_pipeline_stats_t pipeline;
+  ecs_entity_t pipeline_id;
+  int32_t system_count;
+  ecs_map_t systems;
+} world_stats_t;
+
+#define STATS_HEADER 2
+#define STATS_PIPELINE 3
+#define STATS_SYSTEM 4
+#define STATS_WORLD_FIRST(s)                                                   \
+  ((ecs_metric_t *)ECS_OFFSET(&(s)->world.first_, ECS_SIZEOF(int64_t)))
+#define STATS_WORLD_COUNT(s)                                                   \
+  ((int32_t)((ecs_metric_t *)&(s)->world.last_ - STATS_WORLD_FIRST(s)))
+
+world_stats_t *ecs_stats_new(ecs_world_t *world) {
+  world_stats_t *stats = ecs_os_calloc_t(world_stats_t);
+  ecs_map_init(&stats->systems, NULL);
+  ecs_measure_frame_time(world, true);
+  ecs_measure_system_time(world, true);
+  return stats;
+}
+
+void ecs_stats_free(world_stats_t *stats) {
+  ecs_map_iter_t it = ecs_map_iter(&stats->systems);
+  while (ecs_map_next(&it))
+    ecs_os_free(ecs_map_ptr(&it));
+  ecs_map_fini(&stats->systems);
+  ecs_pipeline_stats_fini(&stats->pipeline);
+  ecs_os_free(stats);
+}
+
+// Takes one sample of the world, its pipeline and every system in it, and
+// returns how many doubles ecs_stats_write will produce for it.
+int32_t ecs_stats_sample(ecs_world_t *world, world_stats_t *stats) {
+  ecs_world_stats_get(world, &stats->world);
+  ecs_entity_t pipeline = ecs_get_pipeline(world);
+  if (!pipeline || !ecs_pipeline_stats_get(world, pipeline, &stats->pipeline))
+    pipeline = 0;
+  stats->pipeline_id = pipeline;
+  stats->system_count = 0;
+  int32_t count = pipeline ? ecs_vec_count(&stats->pipeline.systems) : 0;
+  ecs_entity_t *systems = ecs_vec_first(&stats->pipeline.systems);
+  for (int32_t i = 0; i < count; i++) {
+    if (!systems[i])
+      continue;
+    ecs_system_stats_t *system = ecs_map_ensure_alloc_t(
+        &stats->systems, ecs_system_stats_t, systems[i]);
+    ecs_system_stats_get(world, systems[i], system);
+    stats->system_count++;
+  }
+  return STATS_HEADER + STATS_WORLD_COUNT(stats) + STATS_PIPELINE +
+         count * STATS_SYSTEM;
+}
+
+// Layout: world metric count, pipeline entry count, the current value of each
+// world metric (per-frame delta for counters), pipeline id, active system
+// count, sync point count, then per pipeline entry: system id, time spent,
+// matched tables, matched entities. Merge points have id 0 and carry the
+// sync point's time spent, commands enqueued and system count instead.
+void ecs_stats_write(const world_stats_t *stats, double *out) {
+  const ecs_pipeline_stats_t *pipeline = &stats->pipeline;
+  int32_t world_count = STATS_WORLD_COUNT(stats);
+  int32_t count = stats->pipeline_id ? ecs_vec_count(&pipeline->systems) : 0;
+  int32_t t = stats->world.t;
+  *out++ = world_count;
+  *out++ = count;
+  const ecs_metric_t *metric = STATS_WORLD_FIRST(stats);
+  for (int32_t i = 0; i < world_count; i++)
+    *out++ = metric[i].gauge.avg[t];
+  *out++ = stats->pipeline_id;
+  *out++ = stats->system_count;
+  *out++ = count - stats->system_count;
+  if (!count)
+    return;
+  ecs_entity_t *systems = ecs_vec_first(&pipeline->systems);
+  ecs_sync_stats_t *syncs = ecs_vec_first(&pipeline->sync_points);
+  int32_t i_sync = 0, sync_count = ecs_vec_count(&pipeline->sync_points);
+  int32_t t_sync = (pipeline->t + ECS_STAT_WINDOW - 1) % ECS_STAT_WINDOW;
+  for (int32_t i = 0; i < count; i++, out += STATS_SYSTEM) {
+    out[0] = systems[i];
+    if (!systems[i]) {
+      const ecs_sync_stats_t *sync =
+          i_sync < sync_count ? &syncs[i_sync++] : NULL;
+      out[1] = sync ? sync->time_spent.counter.rate.avg[t_sync] : 0;
+      out[2] = sync ? sync->commands_enqueued.counter.rate.avg[t_sync] : 0;
+      out[3] = sync ? sync->system_count : 0;
+      continue;
+    }
+    const ecs_system_stats_t *system =
+        ecs_map_get_deref(&stats->systems, ecs_system_stats_t, systems[i]);
+    int32_t t_system = system->query.t;
+    out[1] = system->time_spent.counter.rate.avg[t_system];
+    out[2] = system->query.matched_table_count.gauge.avg[t_system];
+    out[3] = system->query.matched_entity_count.gauge.avg[t_system];
+  }
+}
+
+typedef struct {
+  ecs_size_t size;
+  int32_t tables, count;
+  int64_t used, allocated;
+} component_memory_t;
+
+// Appends the memory of one table: its entity array and component columns,
+// with `used` covering the stored rows and `allocated` the capacity. Column
+// totals are also added to each component in `components`.
+static void memoryTable(ecs_world_t *world, ecs_strbuf_t *buf,
+                        ecs_table_t *table, ecs_map_t *components,
+                        bool first) {
+  const ecs_type_t *type = ecs_table_get_type(table);
+  int32_t count = ecs_table_count(table), size = ecs_table_size(table);
+  int64_t used = count * ECS_SIZEOF(ecs_entity_t);
+  int64_t allocated = size * ECS_SIZEOF(ecs_entity_t);
+  for (int32_t i = 0; i < ecs_table_column_count(table); i++) {
+    ecs_id_t id = type->array[ecs_table_column_to_type_index(table, i)];
+    ecs_size_t column = (ecs_size_t)ecs_table_get_column_size(table, i);
+    component_memory_t *component =
+        ecs_map_ensure_alloc_t(components, component_memory_t, id);
+    component->size = column;
+    component->tables++;
+    component->count += count;
+    component->used += (int64_t)count * column;
+    component->allocated += (int64_t)size * column;
+    used += (int64_t)count * column;
+    allocated += (int64_t)size * column;
+  }
+  char *str = ecs_type_str(world, type);
+  char *escaped = flecs_astresc('"', str ? str : "");
+  ecs_strbuf_append(buf,
+                    "%s{\"type\":\"%s\",\"count\":%d,\"size\":%d,"
+                    "\"used\":%lld,\"allocated\":%lld}",
+                    first ? "" : ",", escaped, count, size, (long long)used,
+                    (long long)allocated);
+  ecs_os_free(escaped);
+  ecs_os_free(str);
+}
+
+// Reports where the world's memory goes, as JSON: every table (including
+// empty ones, which keep their columns until ecs_shrink), totals per
+// component, the entity index, name strings, cached queries and the
+// allocation counters of the OS api. Structures private to flecs, like id
+// records and query cache entries, are only counted.
+napi_value ecs_memory_js(napi_env env, ecs_world_t *world) {
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  ecs_map_t components;
+  ecs_map_init(&components, NULL);
+  ecs_strbuf_appendstr(&buf, "{\"tables\":[");
+  memoryTable(world, &buf, ecs_table_find(world, NULL, 0), &components, true);
+  ecs_query_t *tables = ecs_query(
+      world, {.terms = {{EcsAny}},
+              .flags = EcsQueryMatchEmptyTables | EcsQueryMatchPrefab |
+                       EcsQueryMatchDisabled});
+  ecs_iter_t it = ecs_query_iter(world, tables);
+  while (ecs_query_next(&it))
+    memoryTable(world, &buf, it.table, &components, false);
+  ecs_query_fini(tables);
+
+  ecs_strbuf_appendstr(&buf, "],\"components\":[");
+  bool first = true;
+  ecs_map_iter_t cit = ecs_map_iter(&components);
+  while (ecs_map_next(&cit)) {
+    component_memory_t *component = ecs_map_ptr(&cit);
+    ecs_strbuf_append(&buf,
+                      "%s{\"id\":\"%llu\",\"size\":%d,\"tables\":%d,"
+                      "\"count\":%d,\"used\":%lld,\"allocated\":%lld}",
+                      first ? "" : ",",
+                      (unsigned long long)ecs_map_key(&cit), component->size,
+                      component->tables, component->count,
+                      (long long)component->used,
+                      (long long)component->allocated);
+    ecs_os_free(component);
+    first = false;
+  }
+  ecs_map_fini(&components);
+  // Sparse components live outside of tables, one value per entity.
+  ecs_iter_t sit = ecs_each_id(world, EcsSparse);
+  while (ecs_each_next(&sit)) {
+    for (int32_t i = 0; i < sit.count; i++) {
+      const ecs_type_info_t *ti = ecs_get_type_info(world, sit.entities[i]);
+      if (!ti || !ti->size)
+        continue;
+      int32_t count = ecs_count_id(world, sit.entities[i]);
+      ecs_strbuf_append(&buf,
+                        "%s{\"id\":\"%llu\",\"size\":%d,\"tables\":0,"
+                        "\"count\":%d,\"used\":%lld,\"allocated\":%lld}",
+                        first ? "" : ",", (unsigned long long)sit.entities[i],
+                        ti->size, count, (long long)count * ti->size,
+                        (long long)count * ti->size);
+      first = false;
+    }
+  }
+
+  // The entity index keeps a dense id array and pages of records, allocated
+  // for every range of ids in use.
+  ecs_entities_t entities = ecs_get_entities(world);
+  ecs_map_t pages;
+  ecs_map_init(&pages, NULL);
+  for (int32_t i = 0; i < entities.count; i++)
+    ecs_map_ensure(&pages, (uint32_t)entities.ids[i] >> FLECS_ENTITY_PAGE_BITS);
+  int32_t page_count = ecs_map_count(&pages);
+  ecs_map_fini(&pages);
+  ecs_strbuf_append(
+      &buf,
+      "],\"entities\":{\"alive\":%d,\"recyclable\":%d,\"pages\":%d,"
+      "\"bytes\":%lld}",
+      entities.alive_count, entities.count - entities.alive_count, page_count,
+      (long long)entities.count * ECS_SIZEOF(ecs_entity_t) +
+          (long long)page_count * (1 << FLECS_ENTITY_PAGE_BITS) *
+              ECS_SIZEOF(ecs_record_t));
+
+  const ecs_world_info_t *info = ecs_get_world_info(world);
+  ecs_strbuf_append(&buf, ",\"ids\":%lld",
+                    (long long)(info->id_create_total - info->id_delete_total));
+
+  int32_t names = 0;
+  int64_t name_bytes = 0;
+  ecs_iter_t nit = ecs_each_pair(world, ecs_id(EcsIdentifier), EcsWildcard);
+  while (ecs_each_next(&nit)) {
+    EcsIdentifier *identifiers = ecs_field(&nit, EcsIdentifier, 0);
+    for (int32_t i = 0; i < nit.count; i++) {
+      names += ecs_pair_second(world, ecs_field_id(&nit, 0)) == EcsName;
+      name_bytes += identifiers[i].value ? identifiers[i].length + 1 : 0;
+    }
+  }
+  ecs_strbuf_append(&buf, ",\"names\":{\"count\":%d,\"bytes\":%lld}", names,
+                    (long long)name_bytes);
+
+  ecs_strbuf_appendstr(&buf, ",\"queries\":[");
+  first = true;
+  ecs_iter_t qit = ecs_each_pair_t(world, EcsPoly, EcsQuery);
+  while (ecs_each_next(&qit)) {
+    EcsPoly *polys = ecs_field(&qit, EcsPoly, 0);
+    for (int32_t i = 0; i < qit.count; i++) {
+      ecs_query_t *query = polys[i].poly;
+      if (!query || !ecs_query_get_cache_query(query))
+        continue;
+      ecs_query_count_t count = ecs_query_count(query);
+      ecs_strbuf_append(&buf,
+                        "%s{\"id\":\"%llu\",\"results\":%d,\"entities\":%d}",
+                        first ? "" : ",", (unsigned long long)qit.entities[i],
+                        count.results, count.entities);
+      first = false;
+    }
+  }
+
+  ecs_strbuf_append(
+      &buf,
+      "],\"allocator\":{\"mallocs\":%lld,\"callocs\":%lld,\"reallocs\":%lld,"
+      "\"frees\":%lld}}",
+      (long long)ecs_os_api_malloc_count, (long long)ecs_os_api_calloc_count,
+      (long long)ecs_os_api_realloc_count, (long long)ecs_os_api_free_count);
+  char *str = ecs_strbuf_get(&buf);
+  napi_value result;
+  napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &result);
+  ecs_os_free(str);
+  return result;
+}
+
+typedef struct trace_event {
+  uint64_t time;
+  uint32_t name;
+  bool begin;
+} trace_event_t;
+
+#define TRACE_NAME_CACHE_SIZE 64
+
+// One ring buffer per thread, only ever written by its owner. Buffers are
+// never freed because threads keep pointing at them; a new session resets
+// them instead.
+typedef struct trace_buffer {
+  struct trace_buffer *next;
+  int32_t tid, capacity, session;
+  uint64_t written;
+  const char *cache_key[TRACE_NAME_CACHE_SIZE];
+  const char *cache_name[TRACE_NAME_CACHE_SIZE];
+  uint32_t cache_value[TRACE_NAME_CACHE_SIZE];
+  trace_event_t events[];
+} trace_buffer_t;
+
+static struct {
+  pthread_mutex_t lock;
+  trace_buffer_t *buffers;
+  // Written under the lock, read without it by every traced call.
+  _Atomic int32_t session;
+  int32_t capacity, thread_count;
+  char **names;
+  uint32_t name_count, name_size;
+  uint64_t start;
+} trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#ifdef FLECS_PERF_TRACE
+static _Thread_local trace_buffer_t *trace_local;
+
+static uint64_t traceNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static trace_buffer_t *traceBuffer(void) {
+  trace_buffer_t *buffer = trace_local;
+  if (buffer && buffer->session == atomic_load(&trace.session))
+    return buffer;
+  pthread_mutex_lock(&trace.lock);
+  if (buffer && buffer->capacity != trace.capacity) {
+    // Only this thread points at its buffer, so a resized session can free
+    // it once it is unlinked.
+    trace_buffer_t **link = &trace.buffers;
+    while (*link != buffer)
+      link = &(*link)->next;
+    *link = buffer->next;
+    ecs_os_free(buffer);
+    buffer = NULL;
+  }
+  if (!buffer) {
+    buffer = ecs_os_calloc(sizeof(trace_buffer_t) +
+                           trace.capacity * sizeof(trace_event_t));
+    buffer->capacity = trace.capacity;
+    buffer->next = trace.buffers;
+    trace.buffers = buffer;
+  }
+  buffer->tid = ++trace.thread_count;
+  buffer->session = trace.session;
+  buffer->written = 0;
+  pthread_mutex_unlock(&trace.lock);
+  return trace_local = buffer;
+}
+
+static uint32_t traceIntern(trace_buffer_t *buffer, const char *name) {
+  uint32_t slot = ((uintptr_t)name >> 3) % TRACE_NAME_CACHE_SIZE;
+  // Names are usually string literals, but system names can be freed and
+  // their address reused, so a pointer hit is confirmed against the copy.
+  if (buffer->cache_key[slot] == name &&
+      !strcmp(buffer->cache_name[slot], name))
+    return buffer->cache_value[slot];
+  pthread_mutex_lock(&trace.lock);
+  uint32_t id = 0;
+  while (id < trace.name_count && strcmp(trace.names[id], name))
+    id++;
+  if (id == trace.name_count) {
+    if (trace.name_count == trace.name_size) {
+      trace.name_size = trace.name_size ? trace.name_size * 2 : 64;
+      trace.names = ecs_os_realloc_n(trace.names, char *, trace.name_size);
+    }
+    trace.names[trace.name_count++] = ecs_os_strdup(name);
+  }
+  buffer->cache_name[slot] = trace.names[id];
+  pthread_mutex_unlock(&trace.lock);
+  buffer->cache_key[slot] = name;
+  buffer->cache_value[slot] = id;
+  return id;
+}
+
+static void traceRecord(const char *name, bool begin) {
+  uint64_t time = traceNow();
+  trace_buffer_t *buffer = traceBuffer();
+  trace_event_t *event =
+      &buffer->events[buffer->written++ & (buffer->capacity - 1)];
+  event->time = time;
+  event->name = traceIntern(buffer, name ? name : "<anonymous>");
+  event->begin = begin;
+}
+
+static void tracePush(const char *file, size_t line, const char *name) {
+  (void)file;
+  (void)line;
+  traceRecord(name, true);
+}
+
+static void tracePop(const char *file, size_t line, const char *name) {
+  (void)file;
+  (void)line;
+  traceRecord(name, false);
+}
+#endif
+
+// Starts a new tracing session with room for the most recent `capacity`
+// events (rounded up to a power of two) on every thread. Returns false if
+// the library was built without FLECS_PERF_TRACE (make PERF_TRACE=1).
+bool ecs_trace_start(int32_t capacity) {
+#ifndef FLECS_PERF_TRACE
+  (void)capacity;
+  return false;
+#else
+  pthread_mutex_lock(&trace.lock);
+  trace.capacity = (int32_t)nextsize(capacity > 0 ? capacity : 1, 1);
+  atomic_fetch_add(&trace.session, 1);
+  trace.thread_count = 0;
+  trace.start = traceNow();
+  pthread_mutex_unlock(&trace.lock);
+  // Initialize the defaults first, or the first world would reset the hooks.
+  ecs_os_set_api_defaults();
+  ecs_os_api.perf_trace_push_ = tracePush;
+  ecs_os_api.perf_trace_pop_ = tracePop;
+  return true;
+#endif
+}
+
+void ecs_trace_stop(void) {
+  ecs_os_api.perf_trace_push_ = NULL;
+  ecs_os_api.perf_trace_pop_ = NULL;
+}
+
+static void traceAppendEvent(ecs_strbuf_t *buf, bool *first, const char *ph,
+                             int32_t tid, const char *name, double ts) {
+  if (!*first)
+    ecs_strbuf_appendlit(buf, ",\n");
+  *first = false;
+  ecs_strbuf_appendlit(buf, "{\"name\":\"");
+  for (const char *c = name; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      ecs_strbuf_appendch(buf, '\\');
+    ecs_strbuf_appendch(buf, *c);
+  }
+  ecs_strbuf_appendlit(buf, "\",\"ph\":\"");
+  ecs_strbuf_appendstr(buf, ph);
+  ecs_strbuf_appendlit(buf, "\",\"pid\":1,\"tid\":");
+  ecs_strbuf_appendint(buf, tid);
+  ecs_strbuf_appendlit(buf, ",\"ts\":");
+  ecs_strbuf_appendflt(buf, ts, 0);
+}
+
+// Serializes the current session as Chrome trace-event JSON, which both
+// chrome://tracing and the Perfetto UI open directly. Call it while worker
+// threads are idle, e.g. between frames.
+napi_value ecs_trace_export_js(napi_env env) {
+  ecs_strbuf_t buf = ECS_STRBUF_INIT;
+  bool first = true;
+  char thread_name[32];
+  ecs_strbuf_appendlit(&buf, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  pthread_mutex_lock(&trace.lock);
+  for (trace_buffer_t *buffer = trace.buffers; buffer; buffer = buffer->next) {
+    if (buffer->session != trace.session)
+      continue;
+    snprintf(thread_name, sizeof(thread_name), "thread %d", buffer->tid);
+    traceAppendEvent(&buf, &first, "M", buffer->tid, "thread_name", 0);
+    ecs_strbuf_appendlit(&buf, ",\"args\":{\"name\":\"");
+    ecs_strbuf_appendstr(&buf, thread_name);
+    ecs_strbuf_appendlit(&buf, "\"}}");
+    uint64_t i = buffer->written > (uint64_t)buffer->capacity
+                     ? buffer->written - buffer->capacity
+                     : 0;
+    int32_t depth = 0;
+    for (; i < buffer->written; i++) {
+      trace_event_t *event = &buffer->events[i & (buffer->capacity - 1)];
+      // Events before the oldest retained begin were overwritten, so skip
+      // ends that no longer have a matching begin.
+      if (!event->begin && !depth)
+        continue;
+      depth += event->begin ? 1 : -1;
+      traceAppendEvent(&buf, &first, event->begin ? "B" : "E", buffer->tid,
+                       trace.names[event->name],
+                       (double)(event->time - trace.start) / 1000.0);
+      ecs_strbuf_appendch(&buf, '}');
+    }
+  }
+  pthread_mutex_unlock(&trace.lock);
+  ecs_strbuf_appendlit(&buf, "]}");
+  char *str = ecs_strbuf_get(&buf);
+  napi_value result;
+  napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &result);
+  ecs_os_free(str);
+  return result;
+}
+
+// A REST server that never opens a socket: requests come in through
+// ecs_rest_request_js from the embedding HTTP server instead.
+ecs_http_server_t *ecs_rest_init(ecs_world_t *world) {
+  return ecs_rest_server_init(world, &(ecs_http_server_desc_t){0});
+}
+
+napi_value ecs_rest_request_js(napi_env env, ecs_http_server_t *srv,
+                               const char *method, const char *url,
+                               const char *body) {
+  ecs_http_reply_t reply = ECS_HTTP_REPLY_INIT;
+  ecs_http_server_request(srv, method, url, body, &reply);
+  ecs_size_t length = ecs_strbuf_written(&reply.body);
+  char *content = ecs_strbuf_get(&reply.body);
+  char *headers = ecs_strbuf_get(&reply.headers);
+  napi_value result, value;
+  napi_create_array_with_length(env, 4, &result);
+  napi_create_int32(env, reply.code, &value);
+  napi_set_element(env, result, 0, value);
+  napi_create_string_utf8(env, reply.content_type ? reply.content_type : "",
+                          NAPI_AUTO_LENGTH, &value);
+  napi_set_element(env, result, 1, value);
+  napi_create_string_utf8(env, headers ? headers : "", NAPI_AUTO_LENGTH,
+                          &value);
+  napi_set_element(env, result, 2, value);
+  napi_create_string_utf8(env, content ? content : "", length, &value);
+  napi_set_element(env, result, 3, value);
+  ecs_os_free(content);
+  ecs_os_free(headers);
+  return result;
+}
+
+static void packWrite(ecs_vec_t *out, const void *data, ecs_size_t size) {
+  if (size)
+    memcpy(ecs_vec_grow_t(NULL, out, char, size), data, size);
+}
+
+static void packWriteStr(ecs_vec_t *out, const char *str) {
+  uint32_t len = str ? (uint32_t)strlen(str) : 0;
+  packWrite(out, &len, sizeof(len));
+  packWrite(out, str, len);
+}
+
+enum { PACK_TAG, PACK_BYTES, PACK_JSON };
+
+// Packs an entity for another world: its id, name, and every id it has
+// written by path so both sides can register components in any order.
+// Trivially copyable components travel as raw bytes, others with
+// reflection data as JSON. Returns the packed size, which is only written
+// to `buffer` when it fits in `capacity`, -1 if the entity is not alive and
+// -2 if it has children, which would be left behind.
+int32_t ecs_entity_pack(ecs_world_t *world, ecs_entity_t entity,
+                        uint8_t *buffer, int32_t capacity) {
+  const ecs_type_t *type = ecs_get_type(world, entity);
+  if (!type)
+    return -1;
+  if (ecs_count_id(world, ecs_childof(entity)))
+    return -2;
+  ecs_vec_t out;
+  ecs_vec_init_t(NULL, &out, char, 256);
+  uint32_t count = 0;
+  packWrite(&out, &entity, sizeof(entity));
+  packWrite(&out, &count, sizeof(count));
+  packWriteStr(&out, ecs_get_name(world, entity));
+  for (int32_t i = 0; i < type->count; i++) {
+    ecs_id_t id = type->array[i];
+    if (ECS_IS_PAIR(id) && ECS_PAIR_FIRST(id) == ecs_id(EcsIdentifier))
+      continue;
+    const ecs_type_info_t *ti = ecs_get_type_info(world, id);
+    const void *ptr = ti ? ecs_get_id(world, entity, id) : NULL;
+    uint8_t kind = PACK_TAG;
+    char *json = NULL;
+    if (ptr && !ti->hooks.copy && !ti->hooks.ctor)
+      kind = PACK_BYTES;
+    else if (ptr && (json = ecs_ptr_to_json(world, ti->component, ptr)))
+      kind = PACK_JSON;
+    else if (ptr)
+      continue;
+    char *path = ecs_id_str(world, id);
+    packWrite(&out, &kind, sizeof(kind));
+    packWriteStr(&out, path);
+    if (kind == PACK_BYTES) {
+      uint32_t size = (uint32_t)ti->size;
+      packWrite(&out, &size, sizeof(size));
+      packWrite(&out, ptr, ti->size);
+    } else if (kind == PACK_JSON) {
+      packWriteStr(&out, json);
+    }
+    ecs_os_free(path);
+    ecs_os_free(json);
+    count++;
+  }
+  memcpy(ecs_vec_get_t(&out, char, sizeof(entity)), &count, sizeof(count));
+  int32_t size = ecs_vec_count(&out);
+  if (buffer && size <= capacity)
+    memcpy(buffer, ecs_vec_first(&out), size);
+  ecs_vec_fini_t(NULL, &out, char);
+  return size;
+}
+
+static const uint8_t *packReadStr(const uint8_t *p, const uint8_t *end,
+                                  const char **str, uint32_t *len) {
+  if (end - p < (ptrdiff_t)sizeof(*len))
+    return NULL;
+  memcpy(len, p, sizeof(*len));
+  p += sizeof(*len);
+  if ((uint32_t)(end - p) < *len)
+    return NULL;
+  *str = (const char *)p;
+  return p + *len;
+}
+
+// Entities migrated away stay alive as disabled, empty children of
+// flecs.migrated, so the sending world never recycles their ids for new
+// entities and takes them back unchanged when they return.
+static ecs_entity_t packTombstones(ecs_world_t *world) {
+  return ecs_entity(world, {.name = "migrated", .parent = EcsFlecs});
+}
+
+// Clears an entity that was packed and sent to another world, keeping its id
+// reserved in this one.
+void ecs_entity_tombstone(ecs_world_t *world, ecs_entity_t entity) {
+  if (!ecs_is_alive(world, entity))
+    return;
+  ecs_clear(world, entity);
+  ecs_add_pair(world, entity, EcsChildOf, packTombstones(world));
+  ecs_enable(world, entity, false);
+}
+
+// Recreates an entity packed by ecs_entity_pack under the same id, reusing
+// its tombstone if it was migrated away from this world before. Ids whose
+// path does not resolve in this world are skipped. Returns the entity, or 0
+// if the buffer is malformed, its id is alive here with another generation,
+// a value fails to parse or its name is taken by another entity; an entity
+// created for it is deleted or turned back into a tombstone.
+ecs_entity_t ecs_entity_unpack(ecs_world_t *world, const uint8_t *buffer,
+                               int32_t size) {
+  const uint8_t *p = buffer, *end = buffer + size;
+  ecs_entity_t entity;
+  uint32_t count, len;
+  const char *str;
+  char *tmp = NULL;
+  if (size < (int32_t)(sizeof(entity) + sizeof(count)))
+    return 0;
+  memcpy(&entity, p, sizeof(entity));
+  memcpy(&count, p + sizeof(entity), sizeof(count));
+  p += sizeof(entity) + sizeof(count);
+  const char *name;
+  uint32_t name_len;
+  if (!(p = packReadStr(p, end, &name, &name_len)))
+    return 0;
+  ecs_entity_t current = ecs_get_alive(world, (uint32_t)entity);
+  if (current && current != entity)
+    return 0;
+  ecs_entity_t tombstones = ecs_lookup_child(world, EcsFlecs, "migrated");
+  bool tombstone = current && tombstones &&
+                   ecs_has_pair(world, entity, EcsChildOf, tombstones);
+  bool created = !current || tombstone;
+  if (tombstone)
+    ecs_clear(world, entity);
+  else
+    ecs_make_alive(world, entity);
+  for (uint32_t i = 0; i < count; i++) {
+    if (p >= end)
+      goto error;
+    uint8_t kind = *p++;
+    if (!(p = packReadStr(p, end, &str, &len)))
+      goto error;
+    tmp = ecs_os_realloc(tmp, len + 1);
+    memcpy(tmp, str, len);
+    tmp[len] = '\0';
+    ecs_id_t id = ecs_id_from_str(world, tmp);
+    if (kind != PACK_TAG && !(p = packReadStr(p, end, &str, &len)))
+      goto error;
+    if (!id)
+      continue;
+    if (kind == PACK_TAG) {
+      ecs_add_id(world, entity, id);
+    } else if (kind == PACK_BYTES) {
+      const ecs_type_info_t *ti = ecs_get_type_info(world, id);
+      if (ti && ti->size == (ecs_size_t)len)
+        ecs_set_id(world, entity, id, len, str);
+    } else {
+      tmp = ecs_os_realloc(tmp, len + 1);
+      memcpy(tmp, str, len);
+      tmp[len] = '\0';
+      const ecs_type_info_t *ti = ecs_get_type_info(world, id);
+      if (!ti)
+        continue;
+      void *ptr = ecs_ensure_id(world, entity, id);
+      if (!ecs_ptr_from_json(world, ti->component, ptr, tmp, NULL))
+        goto error;
+      ecs_modified_id(world, entity, id);
+    }
+  }
+  if (name_len) {
+    tmp = ecs_os_realloc(tmp, name_len + 1);
+    memcpy(tmp, name, name_len);
+    tmp[name_len] = '\0';
+    ecs_entity_t parent = ecs_get_target(world, entity, EcsChildOf, 0);
+    ecs_entity_t other = ecs_lookup_child(world, parent, tmp);
+    if (other && other != entity)
+      goto error;
+    ecs_set_name(world, entity, tmp);
+  }
+  ecs_os_free(tmp);
+  return entity;
+error:
+  if (tombstone)
+    ecs_entity_tombstone(world, entity);
+  else if (created)
+    ecs_delete(world, entity);
+  ecs_os_free(tmp);
+  return 0;
+}
+
+// Whether `entities` include every entity of every table with `id`, in which
+// case removing it can move whole tables. Entities are counted per table,
+// then rows are marked in the matching tables to rule out duplicates.
+static bool batchCoversId(ecs_world_t *world, const ecs_entity_t *entities,
+                          int32_t count, ecs_id_t id) {
+  ecs_map_t tables;
+  ecs_map_init(&tables, NULL);
+  for (int32_t i = 0; i < count; i++) {
+    ecs_record_t *record = ecs_is_alive(world, entities[i])
+                               ? ecs_record_find(world, entities[i])
+                               : NULL;
+    if (record && record->table)
+      (*ecs_map_ensure(&tables, (uintptr_t)record->table))++;
+  }
+  bool covered = false, result = true;
+  ecs_iter_t it = ecs_each_id(world, id);
+  while (result && ecs_each_next(&it)) {
+    ecs_map_val_t *found = ecs_map_get(&tables, (uintptr_t)it.table);
+    result = found && *found == (ecs_map_val_t)it.count;
+    covered = true;
+  }
+  if (!result)
+    ecs_iter_fini(&it);
+  result &= covered;
+  // Tables with `id` now map to a row bitset, the others are cleared.
+  ecs_map_iter_t tit = ecs_map_iter(&tables);
+  while (ecs_map_next(&tit)) {
+    ecs_table_t *table = (ecs_table_t *)(uintptr_t)ecs_map_key(&tit);
+    *ecs_map_ref(&tit, uint64_t) =
+        result && ecs_table_has_id(world, table, id)
+            ? ecs_os_calloc_n(uint64_t, ecs_table_count(table) / 64 + 1)
+            : NULL;
+  }
+  for (int32_t i = 0; result && i < count; i++) {
+    ecs_record_t *record = ecs_is_alive(world, entities[i])
+                               ? ecs_record_find(world, entities[i])
+                               : NULL;
+    uint64_t *rows = record && record->table
+                         ? ecs_map_get_deref(&tables, uint64_t,
+                                             (uintptr_t)record->table)
+                         : NULL;
+    if (!rows)
+      continue;
+    int32_t row = ECS_RECORD_TO_ROW(record->row);
+    result = !(rows[row / 64] & (1llu << (row % 64)));
+    rows[row / 64] |= 1llu << (row % 64);
+  }
+  tit = ecs_map_iter(&tables);
+  while (ecs_map_next(&tit))
+    ecs_os_free(ecs_map_ptr(&tit));
+  ecs_map_fini(&tables);
+  return result;
+}
+
+// Adds or removes `id` for `entities` in one call, skipping dead ones. When
+// they include every holder of `id`, removal goes through ecs_remove_all,
+// which moves whole tables and emits OnRemove once per table. There is no
+// public table-at-a-time move for adds, so those go entity by entity.
+static void batchAddRemove(ecs_world_t *world, const ecs_entity_t *entities,
+                           int32_t count, ecs_id_t id, bool add) {
+  if (!add && !ecs_is_deferred(world) &&
+      batchCoversId(world, entities, count, id)) {
+    ecs_remove_all(world, id);
+    return;
+  }
+  for (int32_t i = 0; i < count; i++) {
+    if (!ecs_is_alive(world, entities[i]))
+      continue;
+    if (add)
+      ecs_add_id(world, entities[i], id);
+    else
+      ecs_remove_id(world, entities[i], id);
+  }
+}
+
+void ecs_add_many(ecs_world_t *world, const ecs_entity_t *entities,
+                  int32_t count, ecs_id_t id) {
+  batchAddRemove(world, entities, count, id, true);
+}
+
+void ecs_remove_many(ecs_world_t *world, const ecs_entity_t *entities,
+                     int32_t count, ecs_id_t id) {
+  batchAddRemove(world, entities, count, id, false);
+}
+
+typedef struct {
+  ecs_vec_t children;
+  bool in_batch;
+} delete_group_t;
+
+// Deletes `entities`, skipping dead ones. Parents in the batch are deleted
+// first, and their children go down with them. The rest are grouped by
+// parent, and a parent whose children are all in the batch has them deleted
+// through ecs_delete_with, which frees whole tables with one OnRemove per
+// table.
+void ecs_delete_many(ecs_world_t *world, const ecs_entity_t *entities,
+                     int32_t count) {
+  ecs_map_t groups;
+  ecs_map_init(&groups, NULL);
+  ecs_table_t *last = NULL;
+  delete_group_t *group = NULL;
+  for (int32_t i = 0; i < count && !ecs_is_deferred(world); i++) {
+    ecs_record_t *record = ecs_is_alive(world, entities[i])
+                               ? ecs_record_find(world, entities[i])
+                               : NULL;
+    if (!record || !record->table)
+      continue;
+    // Batches tend to list the entities of a table together, so the parent
+    // lookup is redone only when the table changes.
+    if (record->table != last) {
+      ecs_id_t childof = 0;
+      last = record->table;
+      group = NULL;
+      if (ecs_search(world, last, ecs_pair(EcsChildOf, EcsWildcard),
+                     &childof) == -1)
+        continue;
+      delete_group_t **ref = ecs_map_ensure_ref(
+          &groups, delete_group_t, ecs_pair_second(world, childof));
+      if (!*ref)
+        *ref = ecs_os_calloc_t(delete_group_t);
+      group = *ref;
+    }
+    if (group)
+      *ecs_vec_append_t(NULL, &group->children, ecs_entity_t) = entities[i];
+  }
+  // Parents in the batch are deleted first, taking their children along.
+  for (int32_t i = 0; i < count && ecs_map_count(&groups); i++) {
+    group = ecs_map_get_deref(&groups, delete_group_t, entities[i]);
+    if (!group)
+      continue;
+    group->in_batch = true;
+    if (ecs_is_alive(world, entities[i]))
+      ecs_delete(world, entities[i]);
+  }
+  ecs_map_iter_t it = ecs_map_iter(&groups);
+  while (ecs_map_next(&it)) {
+    ecs_id_t childof = ecs_pair(EcsChildOf, ecs_map_key(&it));
+    group = ecs_map_ptr(&it);
+    if (!group->in_batch && ecs_is_alive(world, ecs_map_key(&it)) &&
+        batchCoversId(world, ecs_vec_first(&group->children),
+                      ecs_vec_count(&group->children), childof))
+      ecs_delete_with(world, childof);
+    ecs_vec_fini_t(NULL, &group->children, ecs_entity_t);
+    ecs_os_free(group);
+  }
+  ecs_map_fini(&groups);
+  for (int32_t i = 0; i < count; i++)
+    if (ecs_is_alive(world, entities[i]))
+      ecs_delete(world, entities[i]);
+}
+
+// Notifies the rows marked in `rows`, one run of rows at a time. Iterating
+// `query`, which writes `id`, over the run marks the column dirty for change
+// detection and hands the on_set hook the whole run, as flecs does for its
+// own batches. Observers then get a single OnSet for the run.
+static void setManyNotify(ecs_world_t *world, ecs_query_t *query,
+                          ecs_table_t *table, const uint64_t *rows,
+                          const ecs_type_info_t *ti) {
+  ecs_id_t id = query->terms[0].id;
+  int32_t count = ecs_table_count(table), end;
+  for (int32_t row = 0; row < count; row = end) {
+    while (row < count && !(rows[row / 64] & (1llu << (row % 64))))
+      row++;
+    for (end = row; end < count && rows[end / 64] & (1llu << (end % 64));)
+      end++;
+    if (row == end)
+      break;
+    ecs_iter_t it = ecs_query_iter(world, query);
+    ecs_iter_set_var_as_range(&it, 0, &(ecs_table_range_t){table, row,
+                                                            end - row});
+    while (ecs_query_next(&it)) {
+      if (!ti->hooks.on_set)
+        continue;
+      it.event = EcsOnSet;
+      it.event_id = id;
+      it.ctx = ti->hooks.ctx;
+      it.callback_ctx = ti->hooks.binding_ctx;
+      ti->hooks.on_set(&it);
+    }
+    ecs_emit(world, &(ecs_event_desc_t){.event = EcsOnSet,
+                                        .ids = &(ecs_type_t){&id, 1},
+                                        .table = table,
+                                        .offset = row,
+                                        .count = end - row});
+  }
+}
+
+// Copies `count` packed values of component `id` from `values` to the
+// entities, adding it where missing. Entities in consecutive rows of one
+// table are copied as a single block. Returns -1 if `size` bytes do not
+// hold `count` values.
+int32_t ecs_set_many(ecs_world_t *world, const ecs_entity_t *entities,
+                     int32_t count, ecs_id_t id, const void *values,
+                     int32_t size) {
+  const ecs_type_info_t *ti = ecs_get_type_info(world, id);
+  if (!ti || !ti->size || size < (int64_t)count * ti->size)
+    return -1;
+  const char *src = values;
+  if (ecs_is_deferred(world) || ecs_id_get_flags(world, id) & EcsIdIsSparse) {
+    for (int32_t i = 0; i < count; i++)
+      if (ecs_is_alive(world, entities[i]))
+        ecs_set_id(world, entities[i], id, ti->size, src + i * ti->size);
+    return 0;
+  }
+  for (int32_t i = 0; i < count; i++)
+    if (ecs_is_alive(world, entities[i]) &&
+        !ecs_owns_id(world, entities[i], id))
+      ecs_add_id(world, entities[i], id);
+  ecs_map_t tables;
+  ecs_map_init(&tables, NULL);
+  for (int32_t i = 0, n; i < count; i += n) {
+    n = 1;
+    ecs_record_t *record = ecs_is_alive(world, entities[i])
+                               ? ecs_record_find(world, entities[i])
+                               : NULL;
+    void *dst = record && record->table
+                    ? ecs_table_get_id(world, record->table, id,
+                                       ECS_RECORD_TO_ROW(record->row))
+                    : NULL;
+    if (!dst)
+      continue;
+    ecs_table_t *table = record->table;
+    int32_t row = ECS_RECORD_TO_ROW(record->row);
+    for (; i + n < count && ecs_is_alive(world, entities[i + n]); n++) {
+      ecs_record_t *next = ecs_record_find(world, entities[i + n]);
+      if (next->table != table || ECS_RECORD_TO_ROW(next->row) != row + n)
+        break;
+    }
+    if (ti->hooks.copy)
+      ti->hooks.copy(dst, src + i * ti->size, n, ti);
+    else
+      memcpy(dst, src + i * ti->size, n * ti->size);
+    uint64_t **rows = ecs_map_ensure_ref(&tables, uint64_t, (uintptr_t)table);
+    if (!*rows)
+      *rows = ecs_os_calloc_n(uint64_t, ecs_table_count(table) / 64 + 1);
+    for (int32_t r = row; r < row + n; r++)
+      (*rows)[r / 64] |= 1llu << (r % 64);
+  }
+  ecs_query_t *query = ecs_query(
+      world, {.terms = {{.id = id, .src.id = EcsSelf, .inout = EcsOut}},
+              .flags = EcsQueryMatchPrefab | EcsQueryMatchDisabled});
+  // Observers may move entities, so hold their changes until every table
+  // has been notified.
+  ecs_defer_begin(world);
+  ecs_map_iter_t it = ecs_map_iter(&tables);
+  while (ecs_map_next(&it)) {
+    setManyNotify(world, query, (ecs_table_t *)(uintptr_t)ecs_map_key(&it),
+                  ecs_map_ptr(&it), ti);
+    ecs_os_free(ecs_map_ptr(&it));
+  }
+  ecs_defer_end(world);
+  ecs_query_fini(query);
+  ecs_map_fini(&tables);
+  return 0;
+}
+
+// Creates `count` instances of a prefab in one table move. flecs then
+// instantiates the prefab's children for the whole batch.
+int32_t ecs_instantiate(ecs_world_t *world, ecs_entity_t prefab, int32_t count,
+                        ecs_entity_t *out) {
+  if (count <= 0 || !ecs_is_alive(world, prefab))
+    return 0;
+  const ecs_entity_t *ids =
+      ecs_bulk_new_w_id(world, ecs_pair(EcsIsA, prefab), count);
+  if (!ids)
+    return 0;
+  memcpy(out, ids, count * sizeof(ecs_entity_t));
+  return count;
+}
+
+static void memoMarkPrefab(ecs_world_t *world, ecs_entity_t parent) {
+  ecs_iter_t it = ecs_children(world, parent);
+  while (ecs_children_next(&it)) {
+    for (int32_t i = 0; i < it.count; i++) {
+      ecs_add_id(world, it.entities[i], EcsPrefab);
+      memoMarkPrefab(world, it.entities[i]);
+    }
+  }
+}
+
+// Drops the prefabs built by the old body when the template's script is
+// evaluated again. flecs only allows that once the template has no instances
+// left, so nothing inherits from them anymore.
+static void memoReset(ecs_iter_t *it) {
+  ecs_entity_t template = ecs_field_src(it, 0);
+  ecs_entity_t scope = ecs_lookup_child(it->world, template, "memo");
+  if (scope)
+    ecs_delete(it->world, scope);
+}
+
+// The property values of a memo prefab as JSON, to tell colliding hashes
+// apart. Stored in "<Template>.memo_key", which instances do not inherit.
+typedef struct memo_key {
+  char *json;
+} memo_key_t;
+
+static ecs_entity_t memoKey(ecs_world_t *world, ecs_entity_t template) {
+  ecs_entity_t key = ecs_lookup_child(world, template, "memo_key");
+  if (key)
+    return key;
+  key = ecs_struct(
+      world, {.entity = ecs_entity(world, {.name = "memo_key",
+                                           .parent = template}),
+              .members = {{.name = "json", .type = ecs_id(ecs_string_t)}}});
+  ecs_add_pair(world, key, EcsOnInstantiate, EcsDontInherit);
+  return key;
+}
+
+// Returns the prefab holding what `template` builds for `value`, running the
+// template body only the first time a property set is seen. Prefabs live in
+// "<Template>.memo", named by a hash of the property values as JSON.
+static ecs_entity_t templateMemo(ecs_world_t *world, ecs_entity_t template,
+                                 const void *value) {
+  char *key = ecs_ptr_to_json(world, template, value);
+  if (!key)
+    return 0;
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *ch = key; *ch; ch++)
+    hash = (hash ^ (uint8_t)*ch) * 1099511628211ULL;
+  ecs_entity_t scope = ecs_lookup_child(world, template, "memo");
+  if (!scope) {
+    scope = ecs_entity(world, {.name = "memo", .parent = template});
+    if (!ecs_lookup_child(world, template, "memo_reset"))
+      ecs_observer(world, {.entity = ecs_entity(world, {.name = "memo_reset",
+                                                        .parent = template}),
+                           .query.terms = {{.id = ecs_id(EcsScript),
+                                            .src.id = template}},
+                           .events = {EcsOnSet},
+                           .callback = memoReset});
+  }
+  ecs_entity_t memo_key = memoKey(world, template);
+  char name[20];
+  ecs_entity_t prefab;
+  for (;; hash++) {
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    if (!(prefab = ecs_lookup_child(world, scope, name)))
+      break;
+    const memo_key_t *stored = ecs_get_id(world, prefab, memo_key);
+    if (stored && stored->json && !strcmp(stored->json, key)) {
+      ecs_os_free(key);
+      return prefab;
+    }
+  }
+  const ecs_type_info_t *ti = ecs_get_type_info(world, template);
+  prefab = ecs_new(world);
+  ecs_set_id(world, prefab, template, ti->size, value);
+  // Instances get the property values without the template's on_set hook,
+  // so the prefab must not pass the component on.
+  ecs_remove_id(world, prefab, template);
+  ecs_defer_begin(world);
+  memoMarkPrefab(world, prefab);
+  ecs_defer_end(world);
+  ecs_add_id(world, prefab, EcsPrefab);
+  ecs_add_pair(world, prefab, EcsChildOf, scope);
+  ecs_set_name(world, prefab, name);
+  ecs_set_id(world, prefab, memo_key, sizeof(memo_key_t),
+             &(memo_key_t){key});
+  ecs_os_free(key);
+  return prefab;
+}
+
+// Emits one OnSet of `template` per run of instances in consecutive rows,
+// without the on_set hook that would run the template body again.
+static void templateNotify(ecs_world_t *world, ecs_entity_t template,
+                           const ecs_entity_t *ids, int32_t count) {
+  for (int32_t i = 0, end; i < count; i = end) {
+    const ecs_record_t *r = ecs_record_find(world, ids[i]);
+    int32_t row = ECS_RECORD_TO_ROW(r->row);
+    for (end = i + 1; end < count; end++) {
+      const ecs_record_t *next = ecs_record_find(world, ids[end]);
+      if (next->table != r->table ||
+          ECS_RECORD_TO_ROW(next->row) != row + end - i)
+        break;
+    }
+    ecs_emit(world, &(ecs_event_desc_t){.event = EcsOnSet,
+                                        .ids = &(ecs_type_t){&template, 1},
+                                        .table = r->table,
+                                        .offset = row,
+                                        .count = end - i});
+  }
+}
+
+// Creates `count` instances of a script template that share the property
+// values in `props` (JSON). The template body runs once per distinct set of
+// values; instances are built by instantiating the cached result as a prefab.
+// Returns the number of instances, or 0 if the values fail to parse.
+int32_t ecs_template_instantiate(ecs_world_t *world, ecs_entity_t template,
+                                 const char *props, int32_t count,
+                                 ecs_entity_t *out) {
+  if (count <= 0 || ecs_is_deferred(world) ||
+      !ecs_get_type_info(world, template))
+    return 0;
+  void *value = ecs_value_new(world, template);
+  if (!value)
+    return 0;
+  ecs_entity_t prefab = 0;
+  if (ecs_ptr_from_json(world, template, value, props, NULL))
+    prefab = templateMemo(world, template, value);
+  if (!prefab) {
+    ecs_value_free(world, template, value);
+    return 0;
+  }
+  const ecs_entity_t *ids = ecs_bulk_init(
+      world, &(ecs_bulk_desc_t){
+                 .count = count,
+                 .ids = {ecs_pair(EcsIsA, prefab), template},
+             });
+  for (int32_t i = 0; i < count; i++) {
+    void *ptr = ecs_get_mut_id(world, ids[i], template);
+    ecs_value_copy(world, template, ptr, value);
+  }
+  templateNotify(world, template, ids, count);
+  memcpy(out, ids, count * sizeof(ecs_entity_t));
+  ecs_value_free(world, template, value);
+  return count;
+}
+
+// Storage modes for ecs_storage_set, matching the Storage enum in World.ts.
+typedef enum storage_mode {
+  STORAGE_TABLE,
+  STORAGE_SPARSE,
+  STORAGE_UNION,
+  STORAGE_TOGGLE,
+} storage_mode_t;
+
+// Picks how `component` is stored. flecs only accepts these traits before a
+// component is used, and never removes them, so this returns -1 once the
+// component or one of its pairs is in use, or when asked to go back to table
+// storage.
+//   sparse: values live in a sparse set with stable addresses, entities
+//           still change table when it is added or removed
+//   union:  tag relationship whose target changes without changing table,
+//           one target per entity
+//   toggle: stays in the table, ecs_enable_id flips a bit instead of adding
+//           and removing it, and queries skip disabled entities
+int32_t ecs_storage_set(ecs_world_t *world, ecs_entity_t component,
+                        int32_t mode) {
+  static const ecs_entity_t *traits[] = {
+      [STORAGE_SPARSE] = &EcsSparse,
+      [STORAGE_UNION] = &EcsUnion,
+      [STORAGE_TOGGLE] = &EcsCanToggle,
+  };
+  if (mode < STORAGE_TABLE || mode > STORAGE_TOGGLE)
+    return -1;
+  bool current = false;
+  for (int32_t i = STORAGE_SPARSE; i <= STORAGE_TOGGLE; i++) {
+    bool has = ecs_has_id(world, component, *traits[i]);
+    if (has && i == mode)
+      return 0;
+    current |= has;
+  }
+  if (mode == STORAGE_TABLE)
+    return current ? -1 : 0;
+  if (current || (mode == STORAGE_UNION && ecs_get_type_info(world, component)))
+    return -1;
+  if (ecs_id_in_use(world, component) ||
+      ecs_id_in_use(world, ecs_pair(component, EcsWildcard)))
+    return -1;
+  ecs_add_id(world, component, *traits[mode]);
+  return 0;
+}
+
+// Splits a reflected struct into one primitive component per member, named
+// "<Struct>.soa.<member>". Entities that carry those instead of the struct
+// store every member in its own contiguous column. Inline arrays and nested
+// types are left out. Returns the number of member columns, or -1 if the
+// component has no struct reflection data.
+int32_t ecs_soa_init(ecs_world_t *world, ecs_entity_t component) {
+  const EcsStruct *st = ecs_get(world, component, EcsStruct);
+  if (!st)
+    return -1;
+  // Registering columns can move the struct component, but not the member
+  // array it points to.
+  ecs_vec_t members = st->members;
+  ecs_entity_t scope = ecs_entity(world, {.name = "soa", .parent = component});
+  int32_t count = 0;
+  for (int32_t i = 0; i < ecs_vec_count(&members); i++) {
+    ecs_member_t *m = ecs_vec_get_t(&members, ecs_member_t, i);
+    const EcsPrimitive *primitive = ecs_get(world, m->type, EcsPrimitive);
+    if (!primitive || m->count > 1)
+      continue;
+    ecs_primitive_desc_t desc = {.kind = primitive->kind};
+    desc.entity = ecs_entity(world, {.name = m->name, .parent = scope});
+    if (!ecs_has(world, desc.entity, EcsPrimitive))
+      ecs_primitive_init(world, &desc);
+    count++;
+  }
+  return count;
+}
+
+static int32_t soaCopy(ecs_world_t *world, ecs_entity_t entity,
+                       ecs_entity_t component, void *value, ecs_size_t size,
+                       bool set) {
+  const EcsStruct *st = ecs_get(world, component, EcsStruct);
+  const EcsComponent *info = ecs_get(world, component, EcsComponent);
+  ecs_entity_t scope = st ? ecs_lookup_child(world, component, "soa") : 0;
+  if (!scope || !info || size < info->size)
+    return -1;
+  ecs_member_t *members = ecs_vec_first_t(&st->members, ecs_member_t);
+  for (int32_t i = 0; i < ecs_vec_count(&st->members); i++) {
+    ecs_member_t *m = &members[i];
+    ecs_entity_t column = ecs_lookup_child(world, scope, m->name);
+    if (!column)
+      continue;
+    void *field = ECS_OFFSET(value, m->offset);
+    if (set) {
+      ecs_set_id(world, entity, column, m->size, field);
+    } else {
+      const void *ptr = ecs_get_id(world, entity, column);
+      if (ptr)
+        memcpy(field, ptr, m->size);
+    }
+  }
+  return 0;
+}
+
+// Scatters a struct value into the entity's member columns. Returns -1 if
+// the component was not split by ecs_soa_init or `size` is too small.
+int32_t ecs_soa_set(ecs_world_t *world, ecs_entity_t entity,
+                    ecs_entity_t component, const void *value,
+                    ecs_size_t size) {
+  return soaCopy(world, entity, component, (void *)value, size, true);
+}
+
+// Gathers the entity's member columns into a struct value. Members the
+// entity does not have keep their current value in `out`.
+int32_t ecs_soa_get(ecs_world_t *world, ecs_entity_t entity,
+                    ecs_entity_t component, void *out, ecs_size_t size) {
+  return soaCopy(world, entity, component, out, size, false);
+}
+
+typedef enum kernel_op {
+  KERNEL_ADD_SCALED,
+  KERNEL_CLAMP,
+  KERNEL_LERP,
+  KERNEL_DAMP,
+} kernel_op_t;
+
+typedef struct kernel_member {
+  ecs_entity_t component;
+  ecs_size_t size;
+  int32_t offset;
+  ecs_primitive_kind_t kind;
+} kernel_member_t;
+
+typedef struct kernel {
+  kernel_op_t op;
+  ecs_primitive_kind_t kind;
+  kernel_member_t dst, src;
+  int8_t src_field;
+  double a, b;
+} kernel_t;
+
+// Resolves "Component.member" through the struct's reflection data, or a
+// scalar component such as a "Struct.soa.member" column as a whole.
+static bool kernelMember(ecs_world_t *world, const char *path,
+                         kernel_member_t *out) {
+  ecs_entity_t component = ecs_lookup(world, path);
+  const EcsPrimitive *primitive =
+      component ? ecs_get(world, component, EcsPrimitive) : NULL;
+  const char *member = strrchr(path, '.');
+  if (!primitive && member) {
+    char *name = ecs_os_strdup(path);
+    name[member - path] = '\0';
+    component = ecs_lookup(world, name);
+    ecs_os_free(name);
+    member++;
+  }
+  const EcsComponent *info =
+      component ? ecs_get(world, component, EcsComponent) : NULL;
+  if (!info)
+    return false;
+  out->component = component;
+  out->size = info->size;
+  out->offset = 0;
+  if (primitive) {
+    out->kind = primitive->kind;
+    return true;
+  }
+  const EcsStruct *st = ecs_get(world, component, EcsStruct);
+  if (!st || !member)
+    return false;
+  ecs_member_t *members = ecs_vec_first_t(&st->members, ecs_member_t);
+  for (int32_t i = 0; i < ecs_vec_count(&st->members); i++) {
+    if (strcmp(members[i].name, member) || members[i].count > 1)
+      continue;
+    primitive = ecs_get(world, members[i].type, EcsPrimitive);
+    if (!primitive)
+      return false;
+    out->kind = primitive->kind;
+    out->offset = members[i].offset;
+    return true;
+  }
+  return false;
+}
+
+// One loop per op and type. Columns are walked by stride, with separate
+// branches for dense columns so the compiler can vectorize them. A kernel
+// without a src column reads dst itself, so that case only goes through `d`.
+#define KERNEL_LOOP(T, expr)                                                   \
+  if (dst_stride == sizeof(T) && src == dst) {                                 \
+    T *restrict d = (T *)dst;                                                  \
+    for (int32_t i = 0; i < count; i++) {                                      \
+      T *dv = &d[i];                                                           \
+      T sv = *dv;                                                              \
+      (void)sv;                                                                \
+      expr;                                                                    \
+    }                                                                          \
+  } else if (dst_stride == sizeof(T) && src_stride == sizeof(T)) {             \
+    T *restrict d = (T *)dst;                                                  \
+    const T *restrict s = (const T *)src;                                      \
+    for (int32_t i = 0; i < count; i++) {                                      \
+      T *dv = &d[i];                                                           \
+      T sv = s[i];                                                             \
+      (void)sv;                                                                \
+      expr;                                                                    \
+    }                                                                          \
+  } else {                                                                     \
+    for (int32_t i = 0; i < count; i++) {                                      \
+      T *dv = (T *)(dst + i * dst_stride);                                     \
+      T sv = *(const T *)(src + i * src_stride);                               \
+      (void)sv;                                                                \
+      expr;                                                                    \
+    }                                                                          \
+  }
+
+#define KERNEL_DEFINE(T)                                                       \
+  static void kernelRun_##T(                                                   \
+      const kernel_t *k, int32_t count, char *dst, ecs_size_t dst_stride,      \
+      const char *src, ecs_size_t src_stride, double dt) {                     \
+    T a = (T)k->a, b = (T)k->b;                                                \
+    switch (k->op) {                                                           \
+    case KERNEL_ADD_SCALED: {                                                  \
+      T f = (T)(k->a * dt);                                                    \
+      KERNEL_LOOP(T, *dv += sv * f);                                           \
+      break;                                                                   \
+    }                                                                          \
+    case KERNEL_CLAMP:                                                         \
+      KERNEL_LOOP(T, *dv = *dv < a ? a : *dv > b ? b : *dv);                   \
+      break;                                                                   \
+    case KERNEL_LERP: {                                                        \
+      T t = (T)(1.0 - exp(-k->a * dt));                                        \
+      KERNEL_LOOP(T, *dv += (sv - *dv) * t);                                   \
+      break;                                                                   \
+    }                                                                          \
+    case KERNEL_DAMP: {                                                        \
+      T f = (T)exp(-k->a * dt);                                                \
+      KERNEL_LOOP(T, *dv *= f);                                                \
+      break;                                                                   \
+    }                                                                          \
+    }                                                                          \
+  }
+
+KERNEL_DEFINE(float)
+KERNEL_DEFINE(double)
+
+static void kernelRun(ecs_iter_t *it) {
+  const kernel_t *k = it->ctx;
+  char *dst = ecs_field_w_size(it, k->dst.size, 0);
+  ecs_size_t dst_stride = k->dst.size, src_stride = dst_stride;
+  const char *src = dst;
+  if (k->src_field) {
+    src = ecs_field_w_size(it, k->src.size, k->src_field);
+    src_stride = ecs_field_is_self(it, k->src_field) ? k->src.size : 0;
+  }
+  dst += k->dst.offset;
+  src += k->src.offset;
+  if (k->kind == EcsF32)
+    kernelRun_float(k, it->count, dst, dst_stride, src, src_stride,
+                    it->delta_time);
+  else
+    kernelRun_double(k, it->count, dst, dst_stride, src, src_stride,
+                     it->delta_time);
+}
+
+static void kernelFree(void *ctx) { ecs_os_free(ctx); }
+
+// Creates an OnUpdate system applying `op` to the f32 or f64 member `dst`:
+//   add:   dst += src * a * dt
+//   clamp: dst = min(max(dst, a), b)
+//   lerp:  dst moves towards src by 1 - e^(-a * dt)
+//   damp:  dst *= e^(-a * dt)
+// `src` is optional for ops that do not read it and must have the same type
+// as `dst`. Only entities that own `dst` are written; values they inherit
+// from a prefab are shared and left alone. Returns 0 if `op` is unknown or a
+// member does not resolve.
+ecs_entity_t ecs_kernel_init(ecs_world_t *world, const char *name, int32_t op,
+                             const char *dst, const char *src, double a,
+                             double b) {
+  if (op < KERNEL_ADD_SCALED || op > KERNEL_DAMP)
+    return 0;
+  kernel_t k = {.op = op, .a = a, .b = b};
+  if (!kernelMember(world, dst, &k.dst))
+    return 0;
+  k.src = k.dst;
+  if (src && *src && !kernelMember(world, src, &k.src))
+    return 0;
+  if ((k.dst.kind != EcsF32 && k.dst.kind != EcsF64) ||
+      k.src.kind != k.dst.kind)
+    return 0;
+  k.kind = k.dst.kind;
+  k.src_field = k.src.component != k.dst.component;
+  kernel_t *ctx = ecs_os_memdup_t(&k, kernel_t);
+  ecs_system_desc_t desc = {
+      .entity = ecs_entity(world, {.name = name,
+                                   .add = ecs_ids(ecs_dependson(EcsOnUpdate))}),
+      .query.terms = {{.id = k.dst.component,
+                       .src.id = EcsSelf,
+                       .inout = EcsInOut},
+                      {.id = k.src.component, .inout = EcsIn}},
+      .callback = kernelRun,
+      .ctx = ctx,
+      .ctx_free = kernelFree,
+  };
+  if (!k.src_field)
+    desc.query.terms[1] = (ecs_term_t){0};
+  return ecs_system_init(world, &desc);
+}
+
+// Cells are addressed by 21 bits per axis, centered on the origin.
+#define SPATIAL_CELL_BITS 21
+#define SPATIAL_CELL_MAX (1 << (SPATIAL_CELL_BITS - 1))
+
+typedef struct spatial_entry {
+  ecs_entity_t entity;
+  double pos[3];
+} spatial_entry_t;
+
+// Uniform grid over two or three f32/f64 members of one component. `cells`
+// maps a cell key to an ecs_vec_t of entries, `entities` an entity to the key
+// of its cell. Shared by the sync system and its observer, which each hold a
+// reference.
+typedef struct spatial_index {
+  ecs_world_t *world;
+  ecs_entity_t system;
+  kernel_member_t members[3];
+  int32_t dims, refs;
+  double cell_size;
+  ecs_map_t cells, entities;
+} spatial_index_t;
+
+static int64_t spatialCoord(const spatial_index_t *index, double value) {
+  double cell = floor(value / index->cell_size);
+  if (!(cell >= -SPATIAL_CELL_MAX)) // also catches NaN
+    cell = -SPATIAL_CELL_MAX;
+  if (cell > SPATIAL_CELL_MAX - 1)
+    cell = SPATIAL_CELL_MAX - 1;
+  return (int64_t)cell;
+}
+
+static uint64_t spatialKey(const int64_t cell[3]) {
+  uint64_t key = 0;
+  for (int32_t i = 0; i < 3; i++)
+    key = key << SPATIAL_CELL_BITS | (uint64_t)(cell[i] + SPATIAL_CELL_MAX);
+  return key;
+}
+
+static void spatialCell(uint64_t key, int64_t cell[3]) {
+  for (int32_t i = 2; i >= 0; i--) {
+    cell[i] = (int64_t)(key % (1 << SPATIAL_CELL_BITS)) - SPATIAL_CELL_MAX;
+    key >>= SPATIAL_CELL_BITS;
+  }
+}
+
+static void spatialRemove(spatial_index_t *index, ecs_entity_t entity) {
+  ecs_map_val_t *key = ecs_map_get(&index->entities, entity);
+  if (!key)
+    return;
+  ecs_vec_t *cell = ecs_map_get_deref(&index->cells, ecs_vec_t, *key);
+  spatial_entry_t *entries = ecs_vec_first_t(cell, spatial_entry_t);
+  for (int32_t i = 0; i < ecs_vec_count(cell); i++) {
+    if (entries[i].entity == entity) {
+      ecs_vec_remove_t(cell, spatial_entry_t, i);
+      break;
+    }
+  }
+  if (!ecs_vec_count(cell)) {
+    ecs_vec_fini_t(NULL, cell, spatial_entry_t);
+    ecs_map_remove_free(&index->cells, *key);
+  }
+  ecs_map_remove(&index->entities, entity);
+}
+
+static void spatialUpdate(spatial_index_t *index, ecs_entity_t entity,
+                          const char *value) {
+  spatial_entry_t entry = {.entity = entity};
+  int64_t coords[3] = {0};
+  for (int32_t i = 0; i < index->dims; i++) {
+    const kernel_member_t *member = &index->members[i];
+    const char *ptr = value + member->offset;
+    entry.pos[i] =
+        member->kind == EcsF32 ? *(const float *)ptr : *(const double *)ptr;
+    coords[i] = spatialCoord(index, entry.pos[i]);
+  }
+  uint64_t key = spatialKey(coords);
+  ecs_map_val_t *current = ecs_map_get(&index->entities, entity);
+  if (current && *current == key) {
+    ecs_vec_t *cell = ecs_map_get_deref(&index->cells, ecs_vec_t, key);
+    spatial_entry_t *entries = ecs_vec_first_t(cell, spatial_entry_t);
+    for (int32_t i = 0; i < ecs_vec_count(cell); i++)
+      if (entries[i].entity == entity)
+        entries[i] = entry;
+    return;
+  }
+  if (current)
+    spatialRemove(index, entity);
+  ecs_map_insert(&index->entities, entity, key);
+  ecs_vec_t *cell = ecs_map_ensure_alloc_t(&index->cells, ecs_vec_t, key);
+  ecs_vec_init_if_t(cell, spatial_entry_t);
+  *ecs_vec_append_t(NULL, cell, spatial_entry_t) = entry;
+}
+
+static void spatialObserve(ecs_iter_t *it) {
+  spatial_index_t *index = it->ctx;
+  if (it->event == EcsOnRemove) {
+    for (int32_t i = 0; i < it->count; i++)
+      spatialRemove(index, it->entities[i]);
+    return;
+  }
+  ecs_size_t size = index->members[0].size;
+  const char *values = ecs_field_w_size(it, size, 0);
+  for (int32_t i = 0; i < it->count; i++)
+    spatialUpdate(index, it->entities[i], values + i * size);
+}
+
+// Catches values written in place, e.g. by kernels or ecs_get_mut, which do
+// not emit OnSet. Only tables flagged as changed since the last run are read.
+static void spatialSync(ecs_iter_t *it) {
+  spatial_index_t *index = it->ctx;
+  ecs_size_t size = index->members[0].size;
+  while (ecs_query_next(it)) {
+    if (!ecs_iter_changed(it))
+      continue;
+    const char *values = ecs_field_w_size(it, size, 0);
+    for (int32_t i = 0; i < it->count; i++)
+      spatialUpdate(index, it->entities[i], values + i * size);
+  }
+}
+
+static void spatialRelease(void *ctx) {
+  spatial_index_t *index = ctx;
+  if (--index->refs)
+    return;
+  ecs_map_iter_t it = ecs_map_iter(&index->cells);
+  while (ecs_map_next(&it))
+    ecs_vec_fini_t(NULL, (ecs_vec_t *)ecs_map_ptr(&it), spatial_entry_t);
+  ecs_map_fini(&index->cells);
+  ecs_map_fini(&index->entities);
+  ecs_os_free(index);
+}
+
+typedef struct spatial_result {
+  ecs_entity_t *out;
+  int32_t capacity, count;
+} spatial_result_t;
+
+static bool spatialInBox(const spatial_index_t *index, const double pos[3],
+                         const double lo[3], const double hi[3]) {
+  for (int32_t i = 0; i < index->dims; i++)
+    if (pos[i] < lo[i] || pos[i] > hi[i])
+      return false;
+  return true;
+}
+
+static double spatialDist2(const spatial_index_t *index, const double a[3],
+                           const double b[3]) {
+  double d2 = 0;
+  for (int32_t i = 0; i < index->dims; i++)
+    d2 += (a[i] - b[i]) * (a[i] - b[i]);
+  return d2;
+}
+
+static void spatialCollectCell(const spatial_index_t *index, ecs_vec_t *cell,
+                               const double lo[3], const double hi[3],
+                               const double *center, double r2,
+                               spatial_result_t *result) {
+  spatial_entry_t *entries = ecs_vec_first_t(cell, spatial_entry_t);
+  for (int32_t i = 0; i < ecs_vec_count(cell); i++) {
+    if (center ? spatialDist2(index, entries[i].pos, center) > r2
+               : !spatialInBox(index, entries[i].pos, lo, hi))
+      continue;
+    if (result->count < result->capacity)
+      result->out[result->count] = entries[i].entity;
+    result->count++;
+  }
+}
+
+// Visits the cells overlapping [lo, hi], or every cell when there are fewer
+// of those than cells in the box.
+static void spatialCollect(const spatial_index_t *index, const double lo[3],
+                           const double hi[3], const double *center,
+                           double r2, spatial_result_t *result) {
+  int64_t clo[3] = {0}, chi[3] = {0};
+  double volume = 1;
+  for (int32_t i = 0; i < index->dims; i++) {
+    clo[i] = spatialCoord(index, lo[i]);
+    chi[i] = spatialCoord(index, hi[i]);
+    volume *= (double)(chi[i] - clo[i] + 1);
+  }
+  if (volume > ecs_map_count(&index->cells)) {
+    ecs_map_iter_t it = ecs_map_iter(&index->cells);
+    while (ecs_map_next(&it)) {
+      int64_t cell[3];
+      spatialCell(ecs_map_key(&it), cell);
+      bool inside = true;
+      for (int32_t i = 0; i < 3; i++)
+        inside &= cell[i] >= clo[i] && cell[i] <= chi[i];
+      if (inside)
+        spatialCollectCell(index, ecs_map_ptr(&it), lo, hi, center, r2,
+                           result);
+    }
+    return;
+  }
+  int64_t cell[3];
+  for (cell[0] = clo[0]; cell[0] <= chi[0]; cell[0]++)
+    for (cell[1] = clo[1]; cell[1] <= chi[1]; cell[1]++)
+      for (cell[2] = clo[2]; cell[2] <= chi[2]; cell[2]++) {
+        ecs_vec_t *vec =
+            ecs_map_get_deref(&index->cells, ecs_vec_t, spatialKey(cell));
+        if (vec)
+          spatialCollectCell(index, vec, lo, hi, center, r2, result);
+      }
+}
+
+typedef struct spatial_nearest {
+  const spatial_index_t *index;
+  const double *center;
+  int32_t k, count;
+  double *dist2;
+  ecs_entity_t *entities;
+} spatial_nearest_t;
+
+// Keeps the k closest entries sorted by distance.
+static void spatialNearestCell(spatial_nearest_t *nearest, ecs_vec_t *cell) {
+  spatial_entry_t *entries = ecs_vec_first_t(cell, spatial_entry_t);
+  for (int32_t i = 0; i < ecs_vec_count(cell); i++) {
+    double d2 = spatialDist2(nearest->index, entries[i].pos, nearest->center);
+    int32_t j = nearest->count;
+    if (j == nearest->k && d2 >= nearest->dist2[j - 1])
+      continue;
+    if (j == nearest->k)
+      j--;
+    else
+      nearest->count++;
+    for (; j > 0 && nearest->dist2[j - 1] > d2; j--) {
+      nearest->dist2[j] = nearest->dist2[j - 1];
+      nearest->entities[j] = nearest->entities[j - 1];
+    }
+    nearest->dist2[j] = d2;
+    nearest->entities[j] = entries[i].entity;
+  }
+}
+
+// Visits the cells on the surface of the cube `r` cells around `origin`, and
+// returns how many of them exist.
+static int32_t spatialNearestRing(spatial_nearest_t *nearest,
+                                  const int64_t origin[3], int64_t r) {
+  int32_t dims = nearest->index->dims, visited = 0;
+  int64_t lo[3] = {0}, hi[3] = {0}, cell[3];
+  for (int32_t i = 0; i < dims; i++) {
+    lo[i] = origin[i] - r;
+    hi[i] = origin[i] + r;
+  }
+  for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++) {
+    bool edge0 = cell[0] == lo[0] || cell[0] == hi[0];
+    for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++) {
+      bool edge1 = edge0 || cell[1] == lo[1] || cell[1] == hi[1];
+      if (dims == 2 && !edge1) {
+        cell[1] = hi[1] - 1;
+        continue;
+      }
+      for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++) {
+        if (!edge1 && cell[2] != lo[2] && cell[2] != hi[2]) {
+          cell[2] = hi[2] - 1;
+          continue;
+        }
+        bool valid = true;
+        for (int32_t i = 0; i < dims; i++)
+          valid &= cell[i] >= -SPATIAL_CELL_MAX && cell[i] < SPATIAL_CELL_MAX;
+        ecs_vec_t *vec = valid ? ecs_map_get_deref(&nearest->index->cells,
+                                                   ecs_vec_t, spatialKey(cell))
+                               : NULL;
+        if (vec) {
+          spatialNearestCell(nearest, vec);
+          visited++;
+        }
+      }
+    }
+  }
+  return visited;
+}
+
+static spatial_index_t *spatialIndex(ecs_world_t *world, ecs_entity_t system) {
+  const ecs_system_t *sys =
+      ecs_is_alive(world, system) ? ecs_system_get(world, system) : NULL;
+  return sys && sys->run == spatialSync ? sys->ctx : NULL;
+}
+
+// Creates a grid index over the f32/f64 members `x`, `y` and optionally `z`
+// of one component, named as "Component.member". The index is the ctx of the
+// returned OnValidate system, which also owns the observer, and is freed when
+// that entity is deleted. Returns 0 if the members do not resolve.
+ecs_entity_t ecs_spatial_init(ecs_world_t *world, const char *name,
+                              const char *x, const char *y, const char *z,
+                              double cell_size) {
+  spatial_index_t index = {.world = world, .dims = z && *z ? 3 : 2};
+  const char *paths[3] = {x, y, z};
+  for (int32_t i = 0; i < index.dims; i++) {
+    kernel_member_t *member = &index.members[i];
+    if (!kernelMember(world, paths[i], member) ||
+        member->component != index.members[0].component ||
+        (member->kind != EcsF32 && member->kind != EcsF64))
+      return 0;
+  }
+  if (!(cell_size > 0))
+    return 0;
+  index.cell_size = cell_size;
+  spatial_index_t *ctx = ecs_os_memdup_t(&index, spatial_index_t);
+  ecs_map_init(&ctx->cells, NULL);
+  ecs_map_init(&ctx->entities, NULL);
+  ecs_entity_t component = index.members[0].component;
+  ctx->system = ecs_system(
+      world, {.entity = ecs_entity(
+                  world, {.name = name,
+                          .add = ecs_ids(ecs_dependson(EcsOnValidate))}),
+              .query.terms = {{.id = component,
+                               .src.id = EcsSelf,
+                               .inout = EcsIn}},
+              .query.cache_kind = EcsQueryCacheAuto,
+              .run = spatialSync,
+              .ctx = ctx,
+              .ctx_free = spatialRelease});
+  ctx->refs = 1;
+  ecs_observer(world, {.entity = ecs_entity(world, {.parent = ctx->system}),
+                       .query.terms = {{.id = component, .src.id = EcsSelf}},
+                       .events = {EcsOnSet, EcsOnRemove},
+                       .callback = spatialObserve,
+                       .yield_existing = true,
+                       .ctx = ctx,
+                       .ctx_free = spatialRelease});
+  ctx->refs++;
+  return ctx->system;
+}
+
+// Writes up to `capacity` entities within `radius` of (x, y, z) to `out`.
+// Returns the number found, which may exceed `capacity`. `z` is ignored by
+// 2D indices, here and below.
+int32_t ecs_spatial_radius(ecs_world_t *world, ecs_entity_t system, double x,
+                           double y, double z, double radius,
+                           ecs_entity_t *out, int32_t capacity) {
+  spatial_index_t *index = spatialIndex(world, system);
+  if (!index)
+    return -1;
+  double center[3] = {x, y, z};
+  double lo[3] = {x - radius, y - radius, z - radius};
+  double hi[3] = {x + radius, y + radius, z + radius};
+  spatial_result_t result = {out, capacity, 0};
+  spatialCollect(index, lo, hi, center, radius * radius, &result);
+  return result.count;
+}
+
+// Same as ecs_spatial_radius for the box from `min` to `max`, inclusive.
+int32_t ecs_spatial_aabb(ecs_world_t *world, ecs_entity_t system,
+                         double min_x, double min_y, double min_z,
+                         double max_x, double max_y, double max_z,
+                         ecs_entity_t *out, int32_t capacity) {
+  spatial_index_t *index = spatialIndex(world, system);
+  if (!index)
+    return -1;
+  double lo[3] = {min_x, min_y, min_z}, hi[3] = {max_x, max_y, max_z};
+  spatial_result_t result = {out, capacity, 0};
+  spatialCollect(index, lo, hi, NULL, 0, &result);
+  return result.count;
+}
+
+// Writes the `k` entities closest to (x, y, z) to `out`, nearest first, and
+// returns how many were written. Rings of cells are searched outwards until
+// no unvisited cell can be closer than the k-th entity found so far; once a
+// ring has more cells than the index, the remaining cells are scanned
+// instead.
+int32_t ecs_spatial_nearest(ecs_world_t *world, ecs_entity_t system, double x,
+                            double y, double z, int32_t k, ecs_entity_t *out) {
+  spatial_index_t *index = spatialIndex(world, system);
+  if (!index)
+    return -1;
+  double center[3] = {x, y, z};
+  int64_t origin[3] = {0};
+  for (int32_t i = 0; i < index->dims; i++)
+    origin[i] = spatialCoord(index, center[i]);
+  spatial_nearest_t nearest = {index, center, k, 0};
+  if (k <= 0)
+    return 0;
+  nearest.dist2 = ecs_os_malloc_n(double, k);
+  nearest.entities = out;
+  int32_t cells = ecs_map_count(&index->cells), visited = 0;
+  for (int64_t r = 0; visited < cells; r++) {
+    double reach = (double)(r - 1) * index->cell_size;
+    if (r && nearest.count == k && nearest.dist2[k - 1] <= reach * reach)
+      break;
+    double side = (double)(2 * r + 1);
+    double ring = index->dims == 3 ? side * side * side - pow(side - 2, 3)
+                                   : side * side - (side - 2) * (side - 2);
+    if (!r || ring <= cells - visited) {
+      visited += spatialNearestRing(&nearest, origin, r);
+      continue;
+    }
+    ecs_map_iter_t it = ecs_map_iter(&index->cells);
+    while (ecs_map_next(&it)) {
+      int64_t cell[3], dist = 0;
+      spatialCell(ecs_map_key(&it), cell);
+      for (int32_t i = 0; i < index->dims; i++) {
+        int64_t d = cell[i] > origin[i] ? cell[i] - origin[i]
+                                        : origin[i] - cell[i];
+        dist = d > dist ? d : dist;
+      }
+      if (dist >= r)
+        spatialNearestCell(&nearest, ecs_map_ptr(&it));
+    }
+    break;
+  }
+  ecs_os_free(nearest.dist2);
+  return nearest.count;
+}
+
+// Seconds per table of a full ecs_shrink that reallocates oversized columns,
+// used until the compactor has measured one itself.
+#define COMPACT_SHRINK_COST 1e-6
+
+typedef struct {
+  double budget, credit;
+  uint16_t table_age;
+  int32_t shrink_interval, frames;
+  double shrink_cost;
+  ecs_query_t *empty_tables;
+  int64_t tables_deleted, shrinks;
+  double time;
+} compactor_t;
+
+static bool compactorHasEmptyTables(ecs_world_t *world,
+                                    const compactor_t *compactor) {
+  ecs_iter_t it = ecs_query_iter(world, compactor->empty_tables);
+  bool empty = false;
+  while (!empty && ecs_query_next(&it))
+    empty = !it.count;
+  if (empty)
+    ecs_iter_fini(&it);
+  return empty;
+}
+
+// Runs after the frame, when the world is neither deferred nor readonly.
+// Empty tables get their columns freed at half `table_age` frames and are
+// deleted at `table_age`, by ecs_delete_empty_tables within the budget. What
+// a frame leaves of the budget is saved up for a full ecs_shrink, which also
+// fits non-empty columns and the entity index to size. It is due every
+// `shrink_interval` frames and runs once the savings cover its cost,
+// predicted from the last one or COMPACT_SHRINK_COST per table before that.
+// Until then the delete pass is skipped, as on large worlds it takes the
+// whole budget. ecs_shrink deletes every empty table regardless of its age,
+// so it waits for them to age out, but no longer than `table_age` frames.
+static void compactorStep(ecs_world_t *world, void *ptr) {
+  compactor_t *compactor = ptr;
+  ecs_time_t start;
+  ecs_time_measure(&start);
+  int32_t tables = ecs_get_world_info(world)->table_count;
+  bool due = compactor->shrink_interval &&
+             ++compactor->frames >= compactor->shrink_interval;
+  bool saved = compactor->shrink_cost * tables <=
+               compactor->credit + compactor->budget;
+  double spent = 0;
+  if (!due || saved) {
+    compactor->tables_deleted += ecs_delete_empty_tables(
+        world, &(ecs_delete_empty_tables_desc_t){
+                   .clear_generation = compactor->table_age / 2,
+                   .delete_generation = compactor->table_age,
+                   .time_budget_seconds = compactor->budget});
+    spent = ecs_time_measure(&start);
+    tables = ecs_get_world_info(world)->table_count;
+  }
+  if (due && saved &&
+      (compactor->frames >=
+           compactor->shrink_interval + compactor->table_age ||
+       !compactorHasEmptyTables(world, compactor))) {
+    spent += ecs_time_measure(&start);
+    ecs_shrink(world);
+    double shrink = ecs_time_measure(&start);
+    compactor->tables_deleted +=
+        tables - ecs_get_world_info(world)->table_count;
+    compactor->shrink_cost = shrink / (tables ? tables : 1);
+    compactor->frames = 0;
+    compactor->shrinks++;
+    spent += shrink;
+  } else {
+    spent += ecs_time_measure(&start);
+  }
+  if (compactor->shrink_interval)
+    compactor->credit += compactor->budget - spent;
+  compactor->time += spent;
+}
+
+static void compactorRun(ecs_iter_t *it) {
+  ecs_run_post_frame(it->world, compactorStep, it->ctx);
+}
+
+// Creates a system that compacts the world after every frame, spending at
+// most `budget_us` microseconds per frame on average. Only a shrink, which
+// runs in one go, exceeds it on the frame it runs. The compactor is freed
+// when the system is deleted, its query along with the system's children.
+ecs_entity_t ecs_compactor_init(ecs_world_t *world, const char *name,
+                                double budget_us, int32_t table_age,
+                                int32_t shrink_interval) {
+  if (!(budget_us > 0) || table_age < 1 || table_age > UINT16_MAX)
+    return 0;
+  ecs_entity_t system = ecs_entity(
+      world, {.name = name, .add = ecs_ids(ecs_dependson(EcsPostFrame))});
+  compactor_t *compactor = ecs_os_calloc_t(compactor_t);
+  compactor->budget = budget_us / 1e6;
+  compactor->table_age = (uint16_t)table_age;
+  compactor->shrink_interval = shrink_interval;
+  compactor->shrink_cost = COMPACT_SHRINK_COST;
+  compactor->empty_tables = ecs_query(
+      world, {.entity = ecs_entity(world, {.parent = system}),
+              .terms = {{EcsAny}},
+              .flags = EcsQueryMatchEmptyTables | EcsQueryMatchPrefab |
+                       EcsQueryMatchDisabled});
+  return ecs_system(world, {.entity = system,
+                            .run = compactorRun,
+                            .ctx = compactor,
+                            .ctx_free = ecs_os_api.free_});
+}
+
+// Writes the tables deleted, full shrinks run and microseconds spent so far
+// to `out`. Returns false if `system` is not a compactor.
+bool ecs_compactor_stats(ecs_world_t *world, ecs_entity_t system,
+                         double *out) {
+  const ecs_system_t *sys =
+      ecs_is_alive(world, system) ? ecs_system_get(world, system) : NULL;
+  if (!sys || sys->run != compactorRun)
+    return false;
+  const compactor_t *compactor = sys->ctx;
+  out[0] = compactor->tables_deleted;
+  out[1] = compactor->shrinks;
+  out[2] = compactor->time * 1e6;
+  return true;
+}
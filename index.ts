@@ -1,4 +1,12 @@
+export * from "./src/Compactor";
 export * from "./src/Entity";
 export * from "./src/Extension";
+export * from "./src/Kernel";
+export * from "./src/RestServer";
 export * from "./src/ScriptedEntity";
+export * from "./src/Shard";
+export * from "./src/Spatial";
+export * from "./src/Stage";
+export * from "./src/Stats";
+export * from "./src/Tracer";
 export * from "./src/World";
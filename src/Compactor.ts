@@ -0,0 +1,46 @@
+import { Entity } from "./Entity";
+import symbols from "./symbols";
+
+export type CompactorOptions = {
+  name?: string;
+  /**
+   * Microseconds per frame the compactor may spend on average. A shrink runs
+   * in one go on a single frame, paid for by what earlier frames left over.
+   */
+  budgetUs?: number;
+  /**
+   * Frames a table must stay empty before it is deleted. Its columns are
+   * freed halfway there.
+   */
+  tableAge?: number;
+  /**
+   * Frames between full shrinks, which fit non-empty tables and the entity
+   * index to size. A due shrink waits until the unspent budget saved up
+   * covers its cost, predicted from the last one or at 1µs per table before
+   * that, skipping the deletion of empty tables meanwhile. It also waits up
+   * to `tableAge` frames for empty tables to age out, as it deletes those
+   * that are left. 0 disables them.
+   */
+  shrinkInterval?: number;
+};
+
+export type CompactorStats = {
+  tablesDeleted: number;
+  shrinks: number;
+  timeUs: number;
+};
+
+/**
+ * PostFrame system created by `World.compactor()` that frees the memory left
+ * behind by load spikes a little every frame. Disposing the entity stops it.
+ */
+export class Compactor extends Entity {
+  #stats = new Float64Array(3);
+
+  stats(): CompactorStats {
+    if (!symbols.ecs_compactor_stats(this.world, this.native, this.#stats))
+      throw new Error("compactor was deleted");
+    const [tablesDeleted, shrinks, timeUs] = this.#stats;
+    return { tablesDeleted, shrinks, timeUs };
+  }
+}
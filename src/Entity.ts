@@ -1,5 +1,6 @@
 import type { Pointer } from "bun:ffi";
 import symbols from "./symbols";
+import { assertNoQueryJobs, utf8 } from "./utils";
 
 export class Entity implements Disposable {
   constructor(readonly world: Pointer, readonly native: bigint) {}
@@ -10,7 +11,8 @@ export class Entity implements Disposable {
     );
   }
   set name(value: string) {
-    const buffer = new TextEncoder().encode(value + "\0");
+    assertNoQueryJobs(this.world);
+    const buffer = utf8(value);
     symbols.ecs_set_name(this.world, this.native, buffer);
   }
 
@@ -20,23 +22,26 @@ export class Entity implements Disposable {
     );
   }
   set symbol(value: string) {
-    const buffer = new TextEncoder().encode(value + "\0");
+    assertNoQueryJobs(this.world);
+    const buffer = utf8(value);
     symbols.ecs_set_symbol(this.world, this.native, buffer);
   }
 
   set alias(value: string) {
-    const buffer = new TextEncoder().encode(value + "\0");
+    assertNoQueryJobs(this.world);
+    const buffer = utf8(value);
     symbols.ecs_set_alias(this.world, this.native, buffer);
   }
 
   lookup(path: string) {
-    const buffer = new TextEncoder().encode(path + "\0");
+    const buffer = utf8(path);
     const id = symbols.ecs_lookup_child(this.world, this.native, buffer);
     if (id) return new Entity(this.world, id);
     else return null;
   }
 
   add(id: bigint | Entity) {
+    assertNoQueryJobs(this.world);
     symbols.ecs_add_id(
       this.world,
       this.native,
@@ -45,6 +50,7 @@ export class Entity implements Disposable {
   }
 
   remove(id: bigint | Entity) {
+    assertNoQueryJobs(this.world);
     symbols.ecs_remove_id(
       this.world,
       this.native,
@@ -53,12 +59,14 @@ export class Entity implements Disposable {
   }
 
   clear() {
+    assertNoQueryJobs(this.world);
     symbols.ecs_clear(this.world, this.native);
   }
 
   enable(id: bigint | Entity, enabled: boolean): void;
   enable(enabled: boolean): void;
   enable(a: any, b?: any) {
+    assertNoQueryJobs(this.world);
     if (b == null) {
       symbols.ecs_enable(this.world, this.native, a);
     } else {
@@ -99,13 +107,36 @@ export class Entity implements Disposable {
       case GetIdMode.MUTABLE:
         return symbols.ecs_get_mut_id(this.world, this.native, id);
       case GetIdMode.ENSURE:
+        assertNoQueryJobs(this.world);
         return symbols.ecs_ensure_id(this.world, this.native, id);
       case GetIdMode.ENSURE_MODIFIED:
+        assertNoQueryJobs(this.world);
         return symbols.ecs_ensure_modified_id(this.world, this.native, id);
     }
     throw new Error("invalid mode: " + mode);
   }
 
+  /**
+   * Writes a struct value, laid out as in C, to the member columns made by
+   * `World.soa(component)`.
+   */
+  soaSet(component: bigint | Entity, value: ArrayBufferView) {
+    assertNoQueryJobs(this.world);
+    const id = typeof component === "bigint" ? component : component.native;
+    if (
+      symbols.ecs_soa_set(this.world, this.native, id, value, value.byteLength)
+    )
+      throw new Error("failed to copy soa columns");
+  }
+
+  /** Reads the member columns back into `out`; missing members are kept. */
+  soaGet<T extends ArrayBufferView>(component: bigint | Entity, out: T) {
+    const id = typeof component === "bigint" ? component : component.native;
+    if (symbols.ecs_soa_get(this.world, this.native, id, out, out.byteLength))
+      throw new Error("failed to copy soa columns");
+    return out;
+  }
+
   has(id: bigint | Entity) {
     return symbols.ecs_has_id(
       this.world,
@@ -138,6 +169,13 @@ export class Entity implements Disposable {
     );
   }
 
+  fromJSON(json: string | object) {
+    assertNoQueryJobs(this.world);
+    const buffer = utf8(typeof json === "string" ? json : JSON.stringify(json));
+    if (!symbols.ecs_entity_from_json(this.world, this.native, buffer, null))
+      throw new Error("failed to parse json");
+  }
+
   get parent(): Entity | null {
     const id = symbols.ecs_get_parent(this.world, this.native);
     if (id) {
@@ -155,6 +193,7 @@ export class Entity implements Disposable {
   }
 
   [Symbol.dispose]() {
+    assertNoQueryJobs(this.world);
     symbols.ecs_delete(this.world, this.native);
   }
 }
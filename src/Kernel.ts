@@ -0,0 +1,24 @@
+/**
+ * Native OnUpdate kernels created by `World.kernel()`. `dst` and `src` name
+ * f32 or f64 members as `"Component.member"`, or scalar components such as
+ * `World.soa()` columns by path. Only entities that own `dst` are written;
+ * values inherited from a prefab are shared and left alone.
+ *
+ * - `AddScaled`: `dst += src * a * dt`
+ * - `Clamp`: `dst = min(max(dst, a), b)`
+ * - `Lerp`: `dst` moves towards `src` by `1 - e^(-a * dt)`
+ * - `Damp`: `dst *= e^(-a * dt)`
+ */
+export enum KernelOp {
+  AddScaled,
+  Clamp,
+  Lerp,
+  Damp,
+}
+
+export type KernelOptions = {
+  name?: string;
+  src?: string;
+  a?: number;
+  b?: number;
+};
@@ -0,0 +1,50 @@
+import symbols from "./symbols";
+import { utf8 } from "./utils";
+import type { World } from "./World";
+
+/**
+ * The flecs REST API without its socket thread. Pass `fetch` to `Bun.serve`
+ * (or call it from an existing handler) and requests are answered on the JS
+ * thread, between frames.
+ */
+export class RestServer implements Disposable {
+  readonly native;
+  constructor(world: World) {
+    this.native = symbols.ecs_rest_init(world.native)!;
+    if (!this.native) throw new Error("failed to init rest server");
+  }
+
+  fetch = async (request: Request) => {
+    if (request.method === "OPTIONS")
+      return new Response(null, {
+        status: 204,
+        headers: {
+          "Access-Control-Allow-Origin": "*",
+          "Access-Control-Allow-Private-Network": "true",
+          "Access-Control-Allow-Methods": "GET, PUT, DELETE, OPTIONS",
+          "Access-Control-Max-Age": "600",
+        },
+      });
+    const url = new URL(request.url);
+    const body = request.body ? await request.text() : "";
+    const [status, contentType, extra, content] = symbols.ecs_rest_request_js(
+      null,
+      this.native,
+      utf8(request.method),
+      utf8(url.pathname + url.search),
+      body ? utf8(body) : null
+    ) as [number, string, string, string];
+    const headers = new Headers({ "Access-Control-Allow-Origin": "*" });
+    if (contentType) headers.set("Content-Type", contentType);
+    for (const line of extra.split("\r\n")) {
+      const colon = line.indexOf(":");
+      if (colon > 0)
+        headers.append(line.slice(0, colon), line.slice(colon + 1).trim());
+    }
+    return new Response(content, { status, headers });
+  };
+
+  [Symbol.dispose]() {
+    symbols.ecs_rest_server_fini(this.native);
+  }
+}
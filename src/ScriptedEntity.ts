@@ -1,9 +1,21 @@
 import { Entity } from "./Entity";
 import symbols from "./symbols";
+import { assertNoQueryJobs, utf8 } from "./utils";
 
 export class ScriptedEntity extends Entity {
-  update(code: string, template: bigint = 0n) {
-    const buffer = new TextEncoder().encode(code + "\0");
-    symbols.ecs_script_update(this.world, this.native, template, buffer);
+  /**
+   * With `incremental`, the new code is diffed against what the script built
+   * before: entities keep their ids and only changed components are written.
+   * Template instance updates always rebuild.
+   */
+  update(code: string, template: bigint = 0n, { incremental = false } = {}) {
+    assertNoQueryJobs(this.world);
+    symbols.ecs_script_update_code(
+      this.world,
+      this.native,
+      template,
+      utf8(code),
+      incremental
+    );
   }
 }
@@ -0,0 +1,58 @@
+/**
+ * Single-producer, single-consumer message queue over a SharedArrayBuffer,
+ * used to migrate packed entities between worlds on different Workers. Post
+ * `buffer` to the other side and wrap it in a second `ShardChannel` there.
+ */
+export class ShardChannel {
+  readonly buffer: SharedArrayBuffer;
+  #state: Int32Array;
+  #data: Uint8Array;
+  #length = new Uint8Array(4);
+
+  constructor(buffer: SharedArrayBuffer | number = 1 << 20) {
+    // Positions wrap at 2^32, so the capacity has to divide it.
+    if (typeof buffer === "number")
+      buffer = new SharedArrayBuffer(8 + 2 ** Math.ceil(Math.log2(buffer)));
+    this.buffer = buffer;
+    this.#state = new Int32Array(this.buffer, 0, 2);
+    this.#data = new Uint8Array(this.buffer, 8);
+  }
+
+  send(message: Uint8Array) {
+    const head = Atomics.load(this.#state, 0);
+    const tail = this.#state[1];
+    const used = (tail - head) >>> 0;
+    if (used + 4 + message.length > this.#data.length) return false;
+    new DataView(this.#length.buffer).setUint32(0, message.length, true);
+    this.#write(tail, this.#length);
+    this.#write(tail + 4, message);
+    Atomics.store(this.#state, 1, (tail + 4 + message.length) | 0);
+    return true;
+  }
+
+  receive(): Uint8Array | null {
+    const head = this.#state[0];
+    const tail = Atomics.load(this.#state, 1);
+    if (head === tail) return null;
+    this.#read(head, this.#length);
+    const length = new DataView(this.#length.buffer).getUint32(0, true);
+    const message = new Uint8Array(length);
+    this.#read(head + 4, message);
+    Atomics.store(this.#state, 0, (head + 4 + length) | 0);
+    return message;
+  }
+
+  #write(position: number, bytes: Uint8Array) {
+    const offset = (position >>> 0) % this.#data.length;
+    const first = Math.min(bytes.length, this.#data.length - offset);
+    this.#data.set(bytes.subarray(0, first), offset);
+    this.#data.set(bytes.subarray(first), 0);
+  }
+
+  #read(position: number, bytes: Uint8Array) {
+    const offset = (position >>> 0) % this.#data.length;
+    const first = Math.min(bytes.length, this.#data.length - offset);
+    bytes.set(this.#data.subarray(offset, offset + first));
+    bytes.set(this.#data.subarray(0, bytes.length - first), first);
+  }
+}
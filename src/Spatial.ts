@@ -0,0 +1,81 @@
+import { Entity } from "./Entity";
+import symbols from "./symbols";
+
+export type SpatialIndexOptions = {
+  name?: string;
+  /** Grid cell edge length, ideally close to the typical query radius. */
+  cellSize?: number;
+};
+
+/**
+ * Uniform grid over two or three members of a component, created by
+ * `World.spatialIndex()`. It is kept up to date by an OnSet/OnRemove
+ * observer, and by an OnValidate system that reindexes tables changed in
+ * place, e.g. by kernels. Disposing the entity frees the index.
+ *
+ * Native systems can query it with `ecs_spatial_radius`, `ecs_spatial_aabb`
+ * and `ecs_spatial_nearest`, passing this entity. Results are views into a
+ * buffer reused by the next query on this index; copy them to keep them.
+ */
+export class SpatialIndex extends Entity {
+  #ids = new BigUint64Array(64);
+
+  radius([x, y, z = 0]: ArrayLike<number>, radius: number) {
+    return this.#collect((out, capacity) =>
+      symbols.ecs_spatial_radius(
+        this.world,
+        this.native,
+        x,
+        y,
+        z,
+        radius,
+        out,
+        capacity
+      )
+    );
+  }
+
+  aabb([minX, minY, minZ = 0]: ArrayLike<number>, max: ArrayLike<number>) {
+    const [maxX, maxY, maxZ = 0] = max;
+    return this.#collect((out, capacity) =>
+      symbols.ecs_spatial_aabb(
+        this.world,
+        this.native,
+        minX,
+        minY,
+        minZ,
+        maxX,
+        maxY,
+        maxZ,
+        out,
+        capacity
+      )
+    );
+  }
+
+  /** The `k` closest entities, nearest first. */
+  nearest([x, y, z = 0]: ArrayLike<number>, k: number) {
+    if (k > this.#ids.length) this.#ids = new BigUint64Array(k);
+    const count = symbols.ecs_spatial_nearest(
+      this.world,
+      this.native,
+      x,
+      y,
+      z,
+      k,
+      this.#ids
+    );
+    if (count < 0) throw new Error("spatial index was deleted");
+    return this.#ids.subarray(0, count);
+  }
+
+  #collect(query: (out: BigUint64Array, capacity: number) => number) {
+    let count = query(this.#ids, this.#ids.length);
+    if (count > this.#ids.length) {
+      this.#ids = new BigUint64Array(count * 2);
+      count = query(this.#ids, this.#ids.length);
+    }
+    if (count < 0) throw new Error("spatial index was deleted");
+    return this.#ids.subarray(0, count);
+  }
+}
@@ -0,0 +1,36 @@
+import { Entity } from "./Entity";
+import symbols from "./symbols";
+import type { Pointer } from "bun:ffi";
+
+/**
+ * A command queue owned by one thread. Entities bound to a stage record
+ * their changes instead of applying them, and `World.merge()` applies every
+ * stage in creation order. Create stages with `World.stage()` and send
+ * `native` to a Worker, which wraps it with `new Stage(native)`.
+ *
+ * Stages can only record changes to entities that already exist, so create
+ * new entities on the world before handing out the work. Leave the world
+ * alone until the workers are done and `merge()` has run.
+ */
+export class Stage implements Disposable {
+  #owner: Set<Stage> | null;
+  constructor(readonly native: Pointer, owner: Set<Stage> | null = null) {
+    this.#owner = owner;
+    owner?.add(this);
+  }
+
+  entity(id: bigint | Entity) {
+    return new Entity(this.native, typeof id === "bigint" ? id : id.native);
+  }
+
+  /**
+   * Merges what is left in the stage and frees it, once no Worker uses it.
+   * Stages wrapped by a Worker are left alone; disposing the world disposes
+   * the stages it created.
+   */
+  [Symbol.dispose]() {
+    if (!this.#owner?.delete(this)) return;
+    symbols.ecs_merge(this.native);
+    symbols.ecs_stage_free(this.native);
+  }
+}
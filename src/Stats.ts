@@ -0,0 +1,91 @@
+/**
+ * Layout of the array returned by `World.stats()`:
+ *
+ * - `[0]` number of world metrics (W), `[1]` number of pipeline entries (N)
+ * - `[2, 2 + W)` world metrics, indexed by {@link WorldStat}
+ * - `[2 + W]` pipeline id, then active system count and sync point count
+ * - `N` entries of {@link SystemStat}.Stride values each: system id, time
+ *   spent, matched tables, matched entities. Merge points have id 0 and hold
+ *   the sync point's time spent, commands enqueued and system count instead.
+ *
+ * Counters report the delta since the previous sample, gauges the current
+ * value.
+ */
+export enum WorldStat {
+  EntityCount = 2,
+  NotAliveCount,
+  TagCount,
+  ComponentCount,
+  PairCount,
+  TypeCount,
+  IdCreateCount,
+  IdDeleteCount,
+  TableCount,
+  EmptyTableCount,
+  TableCreateCount,
+  TableDeleteCount,
+  QueryCount,
+  ObserverCount,
+  SystemCount,
+  AddCount,
+  RemoveCount,
+  DeleteCount,
+  ClearCount,
+  SetCount,
+  EnsureCount,
+  ModifiedCount,
+  OtherCount,
+  DiscardCount,
+  BatchedEntityCount,
+  BatchedCount,
+  FrameCount,
+  MergeCount,
+  RematchCount,
+  PipelineBuildCount,
+  SystemsRan,
+  ObserversRan,
+  EventEmitCount,
+  WorldTimeRaw,
+  WorldTime,
+  FrameTime,
+  SystemTime,
+  EmitTime,
+  MergeTime,
+  RematchTime,
+  Fps,
+  DeltaTime,
+  AllocCount,
+  ReallocCount,
+  FreeCount,
+  OutstandingAllocCount,
+  BlockAllocCount,
+  BlockFreeCount,
+  BlockOutstandingAllocCount,
+  StackAllocCount,
+  StackFreeCount,
+  StackOutstandingAllocCount,
+  HttpRequestReceivedCount,
+  HttpRequestInvalidCount,
+  HttpRequestHandledOkCount,
+  HttpRequestHandledErrorCount,
+  HttpRequestNotHandledCount,
+  HttpRequestPreflightCount,
+  HttpSendOkCount,
+  HttpSendErrorCount,
+  HttpBusyCount,
+}
+
+export enum PipelineStat {
+  Id = 0,
+  ActiveSystemCount = 1,
+  SyncPointCount = 2,
+  Stride = 3,
+}
+
+export enum SystemStat {
+  Id = 0,
+  TimeSpent = 1,
+  MatchedTableCount = 2,
+  MatchedEntityCount = 3,
+  Stride = 4,
+}
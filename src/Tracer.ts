@@ -0,0 +1,26 @@
+import symbols from "./symbols";
+
+/**
+ * Records flecs perf trace events (systems, merges, observers, table
+ * changes, script evaluation) into a per-thread ring buffer holding the most
+ * recent `capacity` events. `export()` returns Chrome trace-event JSON that
+ * opens in chrome://tracing or ui.perfetto.dev; call it between frames.
+ *
+ * Only one tracer is active at a time, starting another resets the buffers.
+ * Tracing needs the library built with `make -B PERF_TRACE=1`, so that
+ * regular builds do not pay for the hooks.
+ */
+export class Tracer {
+  constructor(capacity = 1 << 16) {
+    if (!symbols.ecs_trace_start(capacity))
+      throw new Error("flecs was built without PERF_TRACE=1");
+  }
+
+  export() {
+    return symbols.ecs_trace_export_js(null) as string;
+  }
+
+  [Symbol.dispose]() {
+    symbols.ecs_trace_stop();
+  }
+}
@@ -1,65 +1,400 @@
+import { Compactor, type CompactorOptions } from "./Compactor";
 import { Entity } from "./Entity";
+import type { KernelOp, KernelOptions } from "./Kernel";
 import { ScriptedEntity } from "./ScriptedEntity";
+import type { ShardChannel } from "./Shard";
+import { SpatialIndex, type SpatialIndexOptions } from "./Spatial";
+import { Stage } from "./Stage";
 import symbols from "./symbols";
-import { utf8 } from "./utils";
+import { assertNoQueryJobs, utf8 } from "./utils";
 import type { Pointer } from "bun:ffi";
 
 export interface Script extends Disposable {
   eval(vars?: Record<string, boolean | number | string>): void;
 }
 
+export interface Expr extends Disposable {
+  /**
+   * Parses on the first call, typing variables from the values passed there;
+   * later calls reuse the folded tree and must pass the same variable types.
+   */
+  eval(vars?: Record<string, boolean | number | string>): unknown;
+}
+
+/**
+ * Component storage for `World.storage()`. flecs only accepts it before the
+ * component is used.
+ *
+ * - `Table`: one column per table; adding or removing moves the entity.
+ * - `Sparse`: values in a sparse set with stable addresses; adding or
+ *   removing still moves the entity to another table.
+ * - `Union`: tag relationship whose target changes without moving the
+ *   entity, one target at a time.
+ * - `Toggle`: add once, then `Entity.enable(id, on)` flips a bit in place;
+ *   queries skip entities where it is disabled.
+ */
+export enum Storage {
+  Table,
+  Sparse,
+  Union,
+  Toggle,
+}
+
+export type QueryOptions = {
+  variables?: Record<string, string | bigint | Entity>;
+  table?: boolean;
+  builtin?: boolean;
+  inherited?: boolean;
+  matches?: boolean;
+  /**
+   * exec() only: find tables through a cached query compiled for these
+   * variable values. Results are the same as without it.
+   */
+  cache?: boolean;
+  /**
+   * Only yield results from this group of a query created with groupBy or
+   * groupByCallback. Throws for other queries and unknown group names.
+   */
+  group?: string | bigint | Entity;
+};
+
+export type QueryGroupOptions = {
+  /** Group tables by the target of this relationship, e.g. a zone. */
+  groupBy?: bigint | Entity;
+  /**
+   * Native `ecs_group_by_action_t` computing a table's group id, e.g. the
+   * ptr of a JSCallback. Receives groupBy as its id argument.
+   */
+  groupByCallback?: Pointer;
+};
+
+export type QueryGroup = {
+  id: bigint;
+  entities: number;
+  tables: number;
+  /** How often tables were matched and unmatched with the group. */
+  matches: number;
+};
+
+export type QueryPlanOp = {
+  index: number;
+  prev: number;
+  next: number;
+  op: string;
+  depth: number;
+  args: string;
+  /** Times the operation was entered, summed over all runs. */
+  enter?: number;
+  /** Times the operation was re-entered to find its next match. */
+  redo?: number;
+};
+
+export type QueryProfile = {
+  runs: number;
+  /** Results and entities yielded per run. */
+  results: number;
+  entities: number;
+  time_us: { avg: number; min: number; max: number };
+  ops: QueryPlanOp[];
+};
+
 export interface Query extends Disposable {
-  exec<T extends unknown>(options?: {
-    variables?: Record<string, string | bigint | Entity>;
-    table?: boolean;
-    builtin?: boolean;
-    inherited?: boolean;
-    matches?: boolean;
-  }): T[];
+  exec<T extends unknown>(options?: QueryOptions): T[];
+  /**
+   * Serializes on a worker thread. Until the promise settles, disposing the
+   * query, progress() and calls that allocate ids, create queries or change
+   * the world throw.
+   */
+  execAsync<T extends unknown>(options?: QueryOptions): Promise<T[]>;
+  /** Parsed from the plan text of flecs 4.0; empty with other versions. */
+  explain(): QueryPlanOp[];
+  /**
+   * flecs has no per-operation timer, so time is per run; enter/redo counts
+   * are only collected when the library is built without NDEBUG.
+   */
+  profile(runs?: number, options?: QueryOptions): QueryProfile;
+  /** Non-empty groups of a query created with groupBy or groupByCallback. */
+  groups(): QueryGroup[];
 }
 
 export class World implements Disposable {
   readonly native = symbols.ecs_init()!;
+  #stats: Pointer | null = null;
+  #statsBuffer = new Float64Array(0);
+  #packBuffer = new Uint8Array(256);
+  #stages = new Set<Stage>();
   constructor() {
     if (!this.native) throw new Error("failed to init ecs world");
   }
 
   progress(frame: number) {
+    assertNoQueryJobs(this.native);
     return symbols.ecs_progress(this.native, frame);
   }
 
   new() {
+    assertNoQueryJobs(this.native);
     const entity = symbols.ecs_new(this.native);
     return new Entity(this.native, entity);
   }
 
   new_named(name: string) {
+    assertNoQueryJobs(this.native);
     const entity = symbols.ecs_set_name(this.native, 0, utf8(name));
     return new Entity(this.native, entity);
   }
 
   new_scripted(code: string) {
+    assertNoQueryJobs(this.native);
     const buffer = utf8(code);
     const entity = symbols.ecs_script_init_code(this.native, buffer);
     return new ScriptedEntity(this.native, entity);
   }
 
+  setEntityRange(min: bigint, max: bigint = 0n) {
+    assertNoQueryJobs(this.native);
+    symbols.ecs_set_entity_range(this.native, min, max);
+  }
+
+  /** Entities with children can not be packed, they would be left behind. */
+  pack(entity: Entity) {
+    assertNoQueryJobs(this.native);
+    let size = symbols.ecs_entity_pack(
+      this.native,
+      entity.native,
+      this.#packBuffer,
+      this.#packBuffer.length
+    );
+    if (size === -1) throw new Error("entity is not alive");
+    if (size < 0) throw new Error("entity has children");
+    if (size > this.#packBuffer.length) {
+      this.#packBuffer = new Uint8Array(size * 2);
+      size = symbols.ecs_entity_pack(
+        this.native,
+        entity.native,
+        this.#packBuffer,
+        this.#packBuffer.length
+      );
+    }
+    return this.#packBuffer.subarray(0, size);
+  }
+
+  unpack(bytes: Uint8Array) {
+    assertNoQueryJobs(this.native);
+    const id = symbols.ecs_entity_unpack(this.native, bytes, bytes.length);
+    if (!id) throw new Error("failed to unpack entity");
+    return new Entity(this.native, id);
+  }
+
+  /**
+   * The entity's id stays reserved here as a disabled tombstone under
+   * flecs.migrated, so ranges set with setEntityRange stay disjoint and the
+   * id is reused if the entity comes back. Deleting a received entity frees
+   * its id in this world instead; migrate it back to retire it.
+   */
+  migrate(entity: Entity, channel: ShardChannel) {
+    assertNoQueryJobs(this.native);
+    if (!channel.send(this.pack(entity))) return false;
+    symbols.ecs_entity_tombstone(this.native, entity.native);
+    return true;
+  }
+
+  receive(channel: ShardChannel) {
+    const entities: Entity[] = [];
+    for (let bytes; (bytes = channel.receive()); )
+      entities.push(this.unpack(bytes));
+    return entities;
+  }
+
+  instantiate(prefab: bigint | Entity, count: number) {
+    assertNoQueryJobs(this.native);
+    const ids = new BigUint64Array(count);
+    const id = typeof prefab === "bigint" ? prefab : prefab.native;
+    if (symbols.ecs_instantiate(this.native, id, count, ids) !== count)
+      throw new Error("failed to instantiate prefab");
+    return ids;
+  }
+
+  addMany(entities: BigUint64Array, id: bigint | Entity) {
+    assertNoQueryJobs(this.native);
+    symbols.ecs_add_many(
+      this.native,
+      entities,
+      entities.length,
+      typeof id === "bigint" ? id : id.native
+    );
+  }
+
+  /**
+   * Removing `id` from every entity that has it moves whole tables, with
+   * one OnRemove per table; otherwise entities are updated one by one.
+   */
+  removeMany(entities: BigUint64Array, id: bigint | Entity) {
+    assertNoQueryJobs(this.native);
+    symbols.ecs_remove_many(
+      this.native,
+      entities,
+      entities.length,
+      typeof id === "bigint" ? id : id.native
+    );
+  }
+
+  /**
+   * Entities with a parent in `entities` are deleted along with it. When a
+   * batch holds every child of a parent, their tables are freed whole, with
+   * one OnRemove per table.
+   */
+  deleteMany(entities: BigUint64Array) {
+    assertNoQueryJobs(this.native);
+    symbols.ecs_delete_many(this.native, entities, entities.length);
+  }
+
+  /**
+   * `values` holds one packed component value per entity, in the order of
+   * `entities`. Entities in consecutive rows of a table are written as one
+   * block and notified with a single OnSet.
+   */
+  setMany(
+    entities: BigUint64Array,
+    component: bigint | Entity,
+    values: ArrayBufferView
+  ) {
+    assertNoQueryJobs(this.native);
+    const id = typeof component === "bigint" ? component : component.native;
+    const result = symbols.ecs_set_many(
+      this.native,
+      entities,
+      entities.length,
+      id,
+      values,
+      values.byteLength
+    );
+    if (result !== 0) throw new Error("failed to set component values");
+  }
+
+  /**
+   * Instances sharing the same property values reuse one evaluation of the
+   * template body. They inherit it through a prefab under "<Template>.memo".
+   * Observers get one OnSet of the template component for the batch, but its
+   * on_set hook, which would run the body again, is skipped. Only
+   * instances made here share prefabs; those a script creates still run the
+   * body each. Evaluating the template again drops the memo.
+   */
+  instantiateTemplate(
+    template: bigint | Entity,
+    props: Record<string, unknown>,
+    count: number
+  ) {
+    assertNoQueryJobs(this.native);
+    const ids = new BigUint64Array(count);
+    const id = typeof template === "bigint" ? template : template.native;
+    const buffer = utf8(JSON.stringify(props));
+    if (
+      symbols.ecs_template_instantiate(this.native, id, buffer, count, ids) !==
+      count
+    )
+      throw new Error("failed to instantiate template");
+    return ids;
+  }
+
+  soa(component: bigint | Entity) {
+    assertNoQueryJobs(this.native);
+    const id = typeof component === "bigint" ? component : component.native;
+    if (symbols.ecs_soa_init(this.native, id) < 0)
+      throw new Error("component has no struct reflection data");
+    const columns: Record<string, Entity> = {};
+    for (const column of new Entity(this.native, id).lookup("soa")!.children)
+      columns[column.name] = column;
+    return columns;
+  }
+
+  kernel(
+    op: KernelOp,
+    dst: string,
+    { name, src, a = 1, b = 0 }: KernelOptions = {}
+  ) {
+    assertNoQueryJobs(this.native);
+    const id = symbols.ecs_kernel_init(
+      this.native,
+      name ? utf8(name) : null,
+      op,
+      utf8(dst),
+      src ? utf8(src) : null,
+      a,
+      b
+    );
+    if (!id) throw new Error("failed to create kernel");
+    return new Entity(this.native, id);
+  }
+
+  storage(component: bigint | Entity, mode: Storage) {
+    assertNoQueryJobs(this.native);
+    const id = typeof component === "bigint" ? component : component.native;
+    if (symbols.ecs_storage_set(this.native, id, mode) < 0)
+      throw new Error("failed to set component storage");
+  }
+
+  /**
+   * Indexes entities by two or three f32/f64 members of one component, given
+   * as `"Component.member"`, e.g. `["Position.x", "Position.y"]`.
+   */
+  spatialIndex(
+    [x, y, z]: string[],
+    { name, cellSize = 1 }: SpatialIndexOptions = {}
+  ) {
+    assertNoQueryJobs(this.native);
+    const id = symbols.ecs_spatial_init(
+      this.native,
+      name ? utf8(name) : null,
+      utf8(x),
+      utf8(y),
+      z ? utf8(z) : null,
+      cellSize
+    );
+    if (!id) throw new Error("failed to resolve spatial index members");
+    return new SpatialIndex(this.native, id);
+  }
+
+  compactor({
+    name,
+    budgetUs = 500,
+    tableAge = 600,
+    shrinkInterval = 3600,
+  }: CompactorOptions = {}) {
+    assertNoQueryJobs(this.native);
+    const id = symbols.ecs_compactor_init(
+      this.native,
+      name ? utf8(name) : null,
+      budgetUs,
+      tableAge,
+      shrinkInterval
+    );
+    if (!id) throw new Error("invalid compactor options");
+    return new Compactor(this.native, id);
+  }
+
   count(id: bigint) {
     return symbols.ecs_count_id(this.native, id);
   }
 
   lookup(path: string) {
+    assertNoQueryJobs(this.native);
     const buffer = utf8(path);
     const id = symbols.ecs_lookup(this.native, buffer);
     return id ? new Entity(this.native, id) : null;
   }
 
   lookupSymbol(symbol: string) {
+    assertNoQueryJobs(this.native);
     const buffer = utf8(symbol);
     const id = symbols.ecs_lookup_symbol(this.native, buffer);
     return id ? new Entity(this.native, id) : null;
   }
 
+  expr(code: string): Expr {
+    return symbols.ecs_expr_parse_js(null, this.native, utf8(code)) as Expr;
+  }
+
   parse(code: string, name = "<input>"): Script {
     return symbols.ecs_script_parse_js(
       null,
@@ -69,15 +404,41 @@ export class World implements Disposable {
     ) as Script;
   }
 
-  query(expr: string): Query {
-    const raw = symbols.ecs_query_expr_js(null, this.native, utf8(expr)) as {
+  query(expr: string, options: QueryGroupOptions = {}): Query {
+    const { groupBy = 0n, groupByCallback = null } = options;
+    const raw = symbols.ecs_query_expr_js(
+      null,
+      this.native,
+      utf8(expr),
+      typeof groupBy === "bigint" ? groupBy : groupBy.native,
+      groupByCallback
+    ) as {
       exec(opt: any): string;
+      execAsync(opt: any): Promise<string>;
+      explain(): string;
+      profile(runs?: number, opt?: any): string;
+      groups(): string;
       [Symbol.dispose](): void;
     };
     return {
       exec(options?: any): any[] {
         return JSON.parse(raw.exec(options)).results;
       },
+      async execAsync(options?: any): Promise<any[]> {
+        return JSON.parse(await raw.execAsync(options)).results;
+      },
+      explain() {
+        return JSON.parse(raw.explain());
+      },
+      profile(runs = 1, options?: QueryOptions) {
+        return JSON.parse(raw.profile(runs, options));
+      },
+      groups() {
+        return JSON.parse(raw.groups()).map((group: any) => ({
+          ...group,
+          id: BigInt(group.id),
+        }));
+      },
       [Symbol.dispose]() {
         return raw[Symbol.dispose]();
       },
@@ -85,15 +446,61 @@ export class World implements Disposable {
   }
 
   defer() {
+    assertNoQueryJobs(this.native);
     return new Defer(this.native);
   }
 
+  stage() {
+    assertNoQueryJobs(this.native);
+    return new Stage(symbols.ecs_stage_new(this.native)!, this.#stages);
+  }
+
+  merge() {
+    assertNoQueryJobs(this.native);
+    for (const stage of this.#stages) symbols.ecs_merge(stage.native);
+  }
+
   toJSON(): EntityDump[] {
+    assertNoQueryJobs(this.native);
     return JSON.parse(symbols.ecs_world_to_json_js(null, this.native) as string)
       .results;
   }
 
+  fromJSON(json: string | EntityDump[], { bulk = true } = {}) {
+    assertNoQueryJobs(this.native);
+    const buffer = utf8(
+      typeof json === "string" ? json : JSON.stringify({ results: json })
+    );
+    const end = bulk
+      ? symbols.ecs_world_from_json_bulk(this.native, buffer)
+      : symbols.ecs_world_from_json(this.native, buffer, null);
+    if (!end) throw new Error("failed to parse json");
+  }
+
+  stats(): Float64Array {
+    assertNoQueryJobs(this.native);
+    this.#stats ??= symbols.ecs_stats_new(this.native)!;
+    const length = symbols.ecs_stats_sample(this.native, this.#stats);
+    if (length > this.#statsBuffer.length)
+      this.#statsBuffer = new Float64Array(length * 2);
+    symbols.ecs_stats_write(this.#stats, this.#statsBuffer);
+    return this.#statsBuffer;
+  }
+
+  memory(): WorldMemory {
+    assertNoQueryJobs(this.native);
+    const memory = JSON.parse(
+      symbols.ecs_memory_js(null, this.native) as string
+    );
+    for (const list of [memory.components, memory.queries])
+      for (const item of list) item.id = BigInt(item.id);
+    return memory;
+  }
+
   [Symbol.dispose]() {
+    assertNoQueryJobs(this.native);
+    if (this.#stats) symbols.ecs_stats_free(this.#stats);
+    for (const stage of this.#stages) stage[Symbol.dispose]();
     symbols.ecs_fini(this.native);
   }
 }
@@ -131,3 +538,47 @@ export type EntityDump = {
   pairs?: Record<string, string>;
   components?: Record<string, any>;
 };
+
+/**
+ * `used` counts the bytes of stored rows, `allocated` those of the reserved
+ * capacity, for the entity array and all component columns.
+ */
+export type TableMemory = {
+  type: string;
+  count: number;
+  /** Rows allocated. */
+  size: number;
+  used: number;
+  allocated: number;
+};
+
+export type ComponentMemory = {
+  id: bigint;
+  size: number;
+  /** Tables with a column for the component, 0 for sparse components. */
+  tables: number;
+  count: number;
+  used: number;
+  allocated: number;
+};
+
+export type WorldMemory = {
+  /** Every table, the root table first. Empty tables keep their columns. */
+  tables: TableMemory[];
+  components: ComponentMemory[];
+  /** The entity index: dense id array plus pages of records. */
+  entities: { alive: number; recyclable: number; pages: number; bytes: number };
+  /** Live id records. */
+  ids: number;
+  /** Named entities and the bytes held by all identifier strings. */
+  names: { count: number; bytes: number };
+  /** Cached queries, including those of systems. */
+  queries: { id: bigint; results: number; entities: number }[];
+  /** Allocation counters of the flecs OS api, shared by all worlds. */
+  allocator: {
+    mallocs: number;
+    callocs: number;
+    reallocs: number;
+    frees: number;
+  };
+};
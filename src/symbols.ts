@@ -13,7 +13,12 @@ const { symbols } = dlopen(lib, {
   ecs_defer_suspend: { args: ["ptr"], returns: "bool" },
   ecs_defer_resume: { args: ["ptr"], returns: "bool" },
 
+  ecs_stage_new: { args: ["ptr"], returns: "ptr" },
+  ecs_stage_free: { args: ["ptr"] },
+  ecs_merge: { args: ["ptr"] },
+
   ecs_new: { args: ["ptr"], returns: "u64" },
+  ecs_set_entity_range: { args: ["ptr", "u64", "u64"] },
   ecs_delete: { args: ["ptr", "u64"] },
   ecs_add_id: { args: ["ptr", "u64", "u64"] },
   ecs_remove_id: { args: ["ptr", "u64", "u64"] },
@@ -40,6 +45,10 @@ const { symbols } = dlopen(lib, {
     args: ["napi_env", "ptr", "u64"],
     returns: "napi_value",
   },
+  ecs_entity_from_json: {
+    args: ["ptr", "u64", "cstring", "ptr"],
+    returns: "ptr",
+  },
   ecs_has_id: { args: ["ptr", "u64", "u64"], returns: "bool" },
   ecs_owns_id: { args: ["ptr", "u64", "u64"], returns: "bool" },
   ecs_get_parent: { args: ["ptr", "u64"], returns: "u64" },
@@ -60,6 +69,10 @@ const { symbols } = dlopen(lib, {
 
   ecs_script_init_code: { args: ["ptr", "cstring"], returns: "u64" },
   ecs_script_update: { args: ["ptr", "u64", "u64", "cstring"], returns: "int" },
+  ecs_script_update_code: {
+    args: ["ptr", "u64", "u64", "cstring", "bool"],
+    returns: "int",
+  },
   ecs_script_clear: { args: ["ptr", "u64", "u64"] },
 
   ecs_script_parse: {
@@ -70,6 +83,11 @@ const { symbols } = dlopen(lib, {
   ecs_script_free: { args: ["ptr"] },
 
   ecs_query_expr_js: {
+    args: ["napi_env", "ptr", "cstring", "u64", "ptr"],
+    returns: "napi_value",
+  },
+  ecs_query_jobs: { args: ["ptr"], returns: "i32" },
+  ecs_expr_parse_js: {
     args: ["napi_env", "ptr", "cstring"],
     returns: "napi_value",
   },
@@ -79,6 +97,81 @@ const { symbols } = dlopen(lib, {
   },
 
   ecs_world_to_json_js: { args: ["napi_env", "ptr"], returns: "napi_value" },
+  ecs_world_from_json: { args: ["ptr", "cstring", "ptr"], returns: "ptr" },
+  ecs_world_from_json_bulk: { args: ["ptr", "cstring"], returns: "ptr" },
+
+  ecs_stats_new: { args: ["ptr"], returns: "ptr" },
+  ecs_stats_free: { args: ["ptr"] },
+  ecs_memory_js: { args: ["napi_env", "ptr"], returns: "napi_value" },
+  ecs_stats_sample: { args: ["ptr", "ptr"], returns: "i32" },
+  ecs_stats_write: { args: ["ptr", "ptr"] },
+
+  ecs_trace_start: { args: ["i32"], returns: "bool" },
+  ecs_trace_stop: { args: [] },
+  ecs_trace_export_js: { args: ["napi_env"], returns: "napi_value" },
+
+  ecs_add_many: { args: ["ptr", "ptr", "i32", "u64"] },
+  ecs_remove_many: { args: ["ptr", "ptr", "i32", "u64"] },
+  ecs_delete_many: { args: ["ptr", "ptr", "i32"] },
+  ecs_set_many: {
+    args: ["ptr", "ptr", "i32", "u64", "ptr", "i32"],
+    returns: "i32",
+  },
+  ecs_instantiate: { args: ["ptr", "u64", "i32", "ptr"], returns: "i32" },
+  ecs_template_instantiate: {
+    args: ["ptr", "u64", "cstring", "i32", "ptr"],
+    returns: "i32",
+  },
+  ecs_storage_set: { args: ["ptr", "u64", "i32"], returns: "i32" },
+  ecs_soa_init: { args: ["ptr", "u64"], returns: "i32" },
+  ecs_soa_set: { args: ["ptr", "u64", "u64", "ptr", "i32"], returns: "i32" },
+  ecs_soa_get: { args: ["ptr", "u64", "u64", "ptr", "i32"], returns: "i32" },
+  ecs_kernel_init: {
+    args: ["ptr", "cstring", "i32", "cstring", "cstring", "f64", "f64"],
+    returns: "u64",
+  },
+  ecs_spatial_init: {
+    args: ["ptr", "cstring", "cstring", "cstring", "cstring", "f64"],
+    returns: "u64",
+  },
+  ecs_spatial_radius: {
+    args: ["ptr", "u64", "f64", "f64", "f64", "f64", "ptr", "i32"],
+    returns: "i32",
+  },
+  ecs_spatial_aabb: {
+    args: [
+      "ptr",
+      "u64",
+      "f64",
+      "f64",
+      "f64",
+      "f64",
+      "f64",
+      "f64",
+      "ptr",
+      "i32",
+    ],
+    returns: "i32",
+  },
+  ecs_spatial_nearest: {
+    args: ["ptr", "u64", "f64", "f64", "f64", "i32", "ptr"],
+    returns: "i32",
+  },
+  ecs_compactor_init: {
+    args: ["ptr", "cstring", "f64", "i32", "i32"],
+    returns: "u64",
+  },
+  ecs_compactor_stats: { args: ["ptr", "u64", "ptr"], returns: "bool" },
+  ecs_entity_pack: { args: ["ptr", "u64", "ptr", "i32"], returns: "i32" },
+  ecs_entity_unpack: { args: ["ptr", "ptr", "i32"], returns: "u64" },
+  ecs_entity_tombstone: { args: ["ptr", "u64"] },
+
+  ecs_rest_init: { args: ["ptr"], returns: "ptr" },
+  ecs_rest_server_fini: { args: ["ptr"] },
+  ecs_rest_request_js: {
+    args: ["napi_env", "ptr", "cstring", "cstring", "cstring"],
+    returns: "napi_value",
+  },
 } as const);
 
 export default symbols;
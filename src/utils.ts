@@ -1,3 +1,16 @@
+import type { Pointer } from "bun:ffi";
+import symbols from "./symbols";
+
 export function utf8(str: string) {
   return new TextEncoder().encode(str + "\0");
 }
+
+/**
+ * Throws while `Query.execAsync()` jobs read `world` on worker threads, for
+ * calls that allocate ids, create queries or change the world. The count is
+ * kept by the native execAsync.
+ */
+export function assertNoQueryJobs(world: Pointer) {
+  if (symbols.ecs_query_jobs(world))
+    throw new Error("world has pending query jobs");
+}
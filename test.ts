@@ -1,4 +1,4 @@
-import { World } from ".";
+import { KernelOp, ShardChannel, World } from ".";
 
 using world = new World();
 
@@ -58,4 +58,163 @@ const d = world.lookup("d")!;
 
 console.log(d?.toJSON())
 
-console.log(world.toJSON())
\ No newline at end of file
+console.log(world.toJSON())
+function check(label: string, ok: boolean) {
+  if (!ok) throw new Error(`check failed: ${label}`);
+  console.log("ok", label);
+}
+
+{
+  const dump = world.toJSON();
+  using plain = new World();
+  using bulk = new World();
+  plain.fromJSON(dump, { bulk: false });
+  bulk.fromJSON(dump);
+  check(
+    "bulk fromJSON matches ecs_world_from_json",
+    JSON.stringify(bulk.toJSON()) === JSON.stringify(plain.toJSON())
+  );
+
+  using reordered = new World();
+  reordered.fromJSON(
+    dump.map(({ components, tags, pairs, id, name, parent }) => ({
+      components,
+      tags,
+      pairs,
+      id,
+      name,
+      parent,
+    }))
+  );
+  check(
+    "bulk fromJSON ignores key order",
+    JSON.stringify(reordered.toJSON()) === JSON.stringify(plain.toJSON())
+  );
+}
+
+{
+  using a = new World();
+  using b = new World();
+  a.setEntityRange(5000n, 6000n);
+  b.setEntityRange(6000n, 7000n);
+  const channel = new ShardChannel(1 << 12);
+  const entity = a.new();
+  check("migrate an unnamed entity", a.migrate(entity, channel));
+  const [received] = b.receive(channel);
+  check("migrated id is kept", received.native === entity.native);
+  check("migrated id is not reused", a.new().native !== entity.native);
+  b.migrate(received, channel);
+  const [back] = a.receive(channel);
+  check("returned id is kept", back.native === entity.native);
+  check("ranges stay disjoint", b.new().native >= 6000n);
+}
+
+{
+  using w = new World();
+  w.parse(`
+struct Drag {
+  value = f32
+}
+Drag {
+  (OnInstantiate, Inherit)
+}
+prefab Slow {
+  Drag: { value: 1 }
+}
+slow_0 : Slow {}
+slow_1 : Slow {}
+fast {
+  Drag: { value: 1 }
+}
+`).eval();
+  w.kernel(KernelOp.Damp, "Drag.value");
+  w.progress(0.5);
+  check(
+    "kernels leave inherited values alone",
+    w.lookup("Slow")!.toJSON().components.Drag.value === 1
+  );
+  check(
+    "kernels write owned values",
+    w.lookup("fast")!.toJSON().components.Drag.value < 1
+  );
+}
+
+{
+  const script = world.new_scripted(`inc_a { Mass: { value: 1 } }`);
+  const before = world.lookup("inc_a")!.native;
+  script.update(
+    `// not Disabled
+inc_a { Mass: { value: 2 } }`,
+    0n,
+    { incremental: true }
+  );
+  const after = world.lookup("inc_a")!;
+  check("incremental update keeps ids", after.native === before);
+  check(
+    "incremental update writes values",
+    after.toJSON().components.Mass.value === 2
+  );
+}
+
+{
+  using w = new World();
+  w.parse(`
+struct Mass {
+  value = f32
+}
+template Box {
+  prop size = f32: 1
+  inner { Mass: { value: $size } }
+}
+box_0 { Box: {} }
+box_1 { Box: {} }
+`).eval();
+  const names = ["box_0", "box_1"];
+  w.setMany(
+    new BigUint64Array(names.map((name) => w.lookup(name)!.native)),
+    w.lookup("Box")!,
+    new Float32Array([3, 4])
+  );
+  check(
+    "setMany runs on_set hooks for the batch",
+    names.every(
+      (name, i) =>
+        w.lookup(`${name}.inner`)!.toJSON().components.Mass.value === i + 3
+    )
+  );
+}
+
+{
+  using w = new World();
+  w.parse(`
+parent_0 { child_0 {} child_1 {} }
+parent_1 { child_0 {} }
+kept { child_0 {} }
+`).eval();
+  const names = [
+    "parent_0.child_0",
+    "parent_0.child_1",
+    "parent_1.child_0",
+    "kept.child_0",
+    "parent_0",
+    "parent_1",
+  ];
+  const entities = names.map((name) => w.lookup(name)!);
+  w.deleteMany(new BigUint64Array(entities.map((entity) => entity.native)));
+  check(
+    "deleteMany deletes parents listed after their children",
+    entities.every((entity) => !entity.isAlive())
+  );
+  check("deleteMany keeps unlisted parents", w.lookup("kept")!.isAlive());
+}
+
+{
+  using w = new World();
+  const compactor = w.compactor({
+    budgetUs: 1,
+    tableAge: 2,
+    shrinkInterval: 2,
+  });
+  for (let i = 0; i < 10000 && !compactor.stats().shrinks; i++) w.progress(0);
+  check("compactor shrinks on a tight budget", compactor.stats().shrinks > 0);
+}